@@ -1,5 +1,7 @@
 #include <Bela.h>
 #include "Watcher.h"
+#include <math.h>
+#include <complex>
 
 static inline const JSONArray& JSONGetArray(JSONObject& root, const std::string& key)
 {
@@ -89,39 +91,535 @@ WatcherManager* Bela_getDefaultWatcherManager()
 }
 
 
-	size_t WatcherManager::getRelTimestampsOffset(size_t dataSize)
+	constexpr size_t WatcherManager::getRelTimestampsOffset(size_t dataSize, size_t frameSize)
 	{
-		size_t maxElements = (kBufSize - kMsgHeaderLength) / (dataSize + sizeof(RelTimestamp));
+		size_t maxElements = (frameSize - kMsgHeaderLength) / (dataSize + sizeof(RelTimestamp));
 		size_t offset = maxElements * dataSize + kMsgHeaderLength;
 		// round down to nearest aligned byte
 		offset = offset & ~(sizeof(RelTimestamp) - 1);
 		return offset;
 	}
-	WatcherManager::WatcherManager(Gui& gui) : pipe(std::string("watcherManager") + std::to_string((unsigned)this), 65536, true, true), gui(gui)
+	constexpr size_t WatcherManager::sanitiseFrameSize(size_t frameSize, size_t typeSize)
 	{
-		gui.setControlDataCallback([this](JSONObject& json, void*) {
-			this->controlCallback(json);
+		// a whole number of elements of any type we may send it as
+		frameSize = ((frameSize + kMsgHeaderLength - 1) / kMsgHeaderLength) * kMsgHeaderLength;
+		// room for at least one value and its RelTimestamp. For types
+		// smaller than a RelTimestamp, the values are only given room
+		// a RelTimestamp at a time, hence the loop
+		if(frameSize < kMsgHeaderLength)
+			frameSize = kMsgHeaderLength;
+		while(getRelTimestampsOffset(typeSize, frameSize) < kMsgHeaderLength + typeSize)
+			frameSize += kMsgHeaderLength;
+		return frameSize;
+	}
+	// A small compiler for the expressions of derived watchers, e.g.:
+	// `a - b`, `db(x)`, `bits(flags, 4, 2)` or `{name~1} * 2`. Watcher
+	// names that aren't plain identifiers go in braces. The program is a
+	// stack machine where each instruction works on whole blocks of
+	// values, so that the loops can be vectorised.
+	struct WatcherManager::Expression {
+		enum Op {
+			kPushSource,
+			kPushConst,
+			// unary
+			kNeg,
+			kNot,
+			kBitNot,
+			kAbs,
+			kSqrt,
+			kExp,
+			kLog,
+			kLog10,
+			kDb,
+			kSin,
+			kCos,
+			kTan,
+			kFloor,
+			kCeil,
+			kRound,
+			// binary
+			kAdd,
+			kSub,
+			kMul,
+			kDiv,
+			kMod,
+			kShl,
+			kShr,
+			kLt,
+			kGt,
+			kLe,
+			kGe,
+			kEq,
+			kNe,
+			kBitAnd,
+			kBitXor,
+			kBitOr,
+			kAnd,
+			kOr,
+			kMin,
+			kMax,
+			kPow,
+			kAtan2,
+			// ternary
+			kBits,
+		};
+		struct Instr {
+			Op op;
+			double constant;
+			size_t source;
+		};
+		std::vector<Instr> program;
+		std::vector<std::string> names; // of the sources, in order of appearance
+		std::string error;
+		bool compile(const std::string& str)
+		{
+			c = str.c_str();
+			program.clear();
+			names.clear();
+			error.clear();
+			nesting = 0;
+			parseBinary(0);
+			skipSpace();
+			if(error.empty() && *c)
+				fail("unexpected character");
+			if(error.empty() && names.empty())
+				error = "no watchers in the expression";
+			// how deep the stack gets
+			size_t depth = 0;
+			maxDepth = 0;
+			for(auto& in : program)
+			{
+				depth = depth + 1 - arity(in.op);
+				maxDepth = std::max(maxDepth, depth);
+			}
+			return error.empty();
+		}
+		// inputs[k] holds n values of the source names[k]
+		void evaluate(const std::vector<const double*>& inputs, size_t n, double* out)
+		{
+			if(stack.size() < maxDepth)
+				stack.resize(maxDepth);
+			for(auto& s : stack)
+			{
+				if(s.size() < n)
+					s.resize(n);
+			}
+			size_t sp = 0;
+			for(auto& in : program)
+			{
+				unsigned int ar = arity(in.op);
+				double* a = ar ? stack[sp - ar].data() : nullptr;
+				const double* b = ar > 1 ? stack[sp - ar + 1].data() : nullptr;
+				const double* x = ar > 2 ? stack[sp - ar + 2].data() : nullptr;
+				switch(in.op)
+				{
+					case kPushSource: memcpy(stack[sp].data(), inputs[in.source], n * sizeof(double)); break;
+					case kPushConst: std::fill_n(stack[sp].data(), n, in.constant); break;
+					case kNeg: apply(a, n, [](double v) { return -v; }); break;
+					case kNot: apply(a, n, [](double v) { return double(0 == v); }); break;
+					case kBitNot: apply(a, n, [](double v) { return double(~toBits(v)); }); break;
+					case kAbs: apply(a, n, [](double v) { return fabs(v); }); break;
+					case kSqrt: apply(a, n, [](double v) { return sqrt(v); }); break;
+					case kExp: apply(a, n, [](double v) { return exp(v); }); break;
+					case kLog: apply(a, n, [](double v) { return log(v); }); break;
+					case kLog10: apply(a, n, [](double v) { return log10(v); }); break;
+					// floored at -400dB so that silence doesn't give -inf
+					case kDb: apply(a, n, [](double v) { return 20 * log10(std::max(fabs(v), 1e-20)); }); break;
+					case kSin: apply(a, n, [](double v) { return sin(v); }); break;
+					case kCos: apply(a, n, [](double v) { return cos(v); }); break;
+					case kTan: apply(a, n, [](double v) { return tan(v); }); break;
+					case kFloor: apply(a, n, [](double v) { return floor(v); }); break;
+					case kCeil: apply(a, n, [](double v) { return ceil(v); }); break;
+					case kRound: apply(a, n, [](double v) { return round(v); }); break;
+					case kAdd: apply(a, b, n, [](double u, double v) { return u + v; }); break;
+					case kSub: apply(a, b, n, [](double u, double v) { return u - v; }); break;
+					case kMul: apply(a, b, n, [](double u, double v) { return u * v; }); break;
+					case kDiv: apply(a, b, n, [](double u, double v) { return u / v; }); break;
+					case kMod: apply(a, b, n, [](double u, double v) { return fmod(u, v); }); break;
+					case kShl: apply(a, b, n, [](double u, double v) { return toBits(v) < 64 ? double(toBits(u) << toBits(v)) : 0.0; }); break;
+					case kShr: apply(a, b, n, [](double u, double v) { return toBits(v) < 64 ? double(toBits(u) >> toBits(v)) : 0.0; }); break;
+					case kLt: apply(a, b, n, [](double u, double v) { return double(u < v); }); break;
+					case kGt: apply(a, b, n, [](double u, double v) { return double(u > v); }); break;
+					case kLe: apply(a, b, n, [](double u, double v) { return double(u <= v); }); break;
+					case kGe: apply(a, b, n, [](double u, double v) { return double(u >= v); }); break;
+					case kEq: apply(a, b, n, [](double u, double v) { return double(u == v); }); break;
+					case kNe: apply(a, b, n, [](double u, double v) { return double(u != v); }); break;
+					case kBitAnd: apply(a, b, n, [](double u, double v) { return double(toBits(u) & toBits(v)); }); break;
+					case kBitXor: apply(a, b, n, [](double u, double v) { return double(toBits(u) ^ toBits(v)); }); break;
+					case kBitOr: apply(a, b, n, [](double u, double v) { return double(toBits(u) | toBits(v)); }); break;
+					// both sides are always evaluated
+					case kAnd: apply(a, b, n, [](double u, double v) { return double(u && v); }); break;
+					case kOr: apply(a, b, n, [](double u, double v) { return double(u || v); }); break;
+					case kMin: apply(a, b, n, [](double u, double v) { return u < v ? u : v; }); break;
+					case kMax: apply(a, b, n, [](double u, double v) { return u > v ? u : v; }); break;
+					case kPow: apply(a, b, n, [](double u, double v) { return pow(u, v); }); break;
+					case kAtan2: apply(a, b, n, [](double u, double v) { return atan2(u, v); }); break;
+					case kBits:
+						// bits(value, lsb, count)
+						for(size_t i = 0; i < n; ++i)
+						{
+							uint64_t count = toBits(x[i]);
+							uint64_t mask = count >= 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+							uint64_t lsb = toBits(b[i]);
+							a[i] = lsb < 64 ? double((toBits(a[i]) >> lsb) & mask) : 0;
+						}
+						break;
+				}
+				sp = sp + 1 - ar;
+			}
+			memcpy(out, stack[0].data(), n * sizeof(double));
+		}
+	private:
+		static uint64_t toBits(double v)
+		{
+			// negative values wrap around as in two's complement. The
+			// conversion is undefined outside of the range of int64_t:
+			// NaN gives 0 and the rest saturates
+			if(std::isnan(v))
+				return 0;
+			if(v >= 9223372036854775808.0)
+				return uint64_t(INT64_MAX);
+			if(v < -9223372036854775808.0)
+				return uint64_t(INT64_MIN);
+			return uint64_t(int64_t(v));
+		}
+		template <typename F>
+		static void apply(double* a, size_t n, F f)
+		{
+			for(size_t i = 0; i < n; ++i)
+				a[i] = f(a[i]);
+		}
+		template <typename F>
+		static void apply(double* a, const double* b, size_t n, F f)
+		{
+			for(size_t i = 0; i < n; ++i)
+				a[i] = f(a[i], b[i]);
+		}
+		static unsigned int arity(Op op)
+		{
+			if(op <= kPushConst)
+				return 0;
+			if(op <= kRound)
+				return 1;
+			if(op <= kAtan2)
+				return 2;
+			return 3;
+		}
+		void fail(const std::string& what)
+		{
+			if(!error.empty())
+				return;
+			if(*c)
+				error = what + " at '" + std::string(c).substr(0, 16) + "'";
+			else
+				error = what + " at the end";
+		}
+		void skipSpace()
+		{
+			while(isspace(*c))
+				++c;
+		}
+		bool match(const char* token, char notFollowedBy = 0)
+		{
+			skipSpace();
+			size_t len = strlen(token);
+			if(strncmp(c, token, len) || (notFollowedBy && notFollowedBy == c[len]))
+				return false;
+			c += len;
 			return true;
+		}
+		void emit(Op op, double constant = 0, size_t source = 0)
+		{
+			program.push_back({op, constant, source});
+		}
+		// from the loosest to the tightest binding, as in C
+		bool matchBinary(unsigned int level, Op& op)
+		{
+			switch(level)
+			{
+				case 0: op = kOr; return match("||");
+				case 1: op = kAnd; return match("&&");
+				case 2: op = kBitOr; return match("|", '|');
+				case 3: op = kBitXor; return match("^");
+				case 4: op = kBitAnd; return match("&", '&');
+				case 5:
+					if(match("==")) { op = kEq; return true; }
+					if(match("!=")) { op = kNe; return true; }
+					return false;
+				case 6:
+					if(match("<=")) { op = kLe; return true; }
+					if(match(">=")) { op = kGe; return true; }
+					if(match("<", '<')) { op = kLt; return true; }
+					if(match(">", '>')) { op = kGt; return true; }
+					return false;
+				case 7:
+					if(match("<<")) { op = kShl; return true; }
+					if(match(">>")) { op = kShr; return true; }
+					return false;
+				case 8:
+					if(match("+")) { op = kAdd; return true; }
+					if(match("-")) { op = kSub; return true; }
+					return false;
+				case 9:
+					if(match("*")) { op = kMul; return true; }
+					if(match("/")) { op = kDiv; return true; }
+					if(match("%")) { op = kMod; return true; }
+					return false;
+			}
+			return false;
+		}
+		void parseBinary(unsigned int level)
+		{
+			if(level > 9)
+				return parseUnary();
+			parseBinary(level + 1);
+			Op op;
+			while(error.empty() && matchBinary(level, op))
+			{
+				parseBinary(level + 1);
+				emit(op);
+			}
+		}
+		void parseUnary()
+		{
+			// everything that nests goes through here: keep the
+			// recursion from running out of stack
+			if(nesting >= kMaxNesting)
+				return fail("too deeply nested");
+			++nesting;
+			if(match("-"))
+			{
+				parseUnary();
+				emit(kNeg);
+			} else if(match("!", '=')) {
+				parseUnary();
+				emit(kNot);
+			} else if(match("~")) {
+				parseUnary();
+				emit(kBitNot);
+			} else if(match("+")) {
+				parseUnary();
+			} else
+				parsePrimary();
+			--nesting;
+		}
+		void source(const std::string& name)
+		{
+			auto it = std::find(names.begin(), names.end(), name);
+			emit(kPushSource, 0, it - names.begin());
+			if(it == names.end())
+				names.push_back(name);
+		}
+		void parsePrimary()
+		{
+			skipSpace();
+			if(match("("))
+			{
+				parseBinary(0);
+				if(!match(")"))
+					fail("missing )");
+			} else if(isdigit(*c) || '.' == *c) {
+				char* end;
+				double value = strtod(c, &end);
+				c = end;
+				emit(kPushConst, value);
+			} else if(match("{")) {
+				const char* start = c;
+				while(*c && '}' != *c)
+					++c;
+				if(!*c)
+					return fail("missing }");
+				source(std::string(start, c - start));
+				++c;
+			} else if(isalpha(*c) || '_' == *c) {
+				const char* start = c;
+				while(isalnum(*c) || '_' == *c)
+					++c;
+				std::string name(start, c - start);
+				if(!match("("))
+				{
+					if("pi" == name)
+						emit(kPushConst, M_PI);
+					else
+						source(name);
+					return;
+				}
+				static const struct {
+					const char* name;
+					Op op;
+				} functions[] = {
+					{"abs", kAbs}, {"sqrt", kSqrt}, {"exp", kExp},
+					{"log", kLog}, {"log10", kLog10}, {"db", kDb},
+					{"sin", kSin}, {"cos", kCos}, {"tan", kTan},
+					{"floor", kFloor}, {"ceil", kCeil}, {"round", kRound},
+					{"min", kMin}, {"max", kMax}, {"pow", kPow},
+					{"atan2", kAtan2}, {"bits", kBits},
+				};
+				for(auto& f : functions)
+				{
+					if(name != f.name)
+						continue;
+					for(unsigned int n = 0; n < arity(f.op); ++n)
+					{
+						if(n && !match(","))
+							return fail(name + "() takes " + std::to_string(arity(f.op)) + " arguments");
+						parseBinary(0);
+					}
+					if(!match(")"))
+						return fail("missing )");
+					emit(f.op);
+					return;
+				}
+				fail("unknown function " + name);
+			} else
+				fail("expected a value");
+		}
+		static constexpr unsigned int kMaxNesting = 64;
+		const char* c;
+		unsigned int nesting;
+		size_t maxDepth = 0;
+		std::vector<std::vector<double>> stack;
+	};
+
+	// A watcher whose values are computed by tapThread from the frames of
+	// other watchers. Values are paired up by their order of arrival, so
+	// the sources should be updated equally often. The audio thread never
+	// sees it: it can be watched, logged and monitored, but all of that
+	// happens on tapThread, using the Streams of its Priv.
+	struct WatcherManager::Derived final : public WatcherBase {
+		struct Source {
+			Priv* priv;
+			std::vector<double> values;
+		};
+		Priv* priv;
+		std::string expression;
+		Expression compiled;
+		std::vector<Source> sources;
+		std::vector<AbsTimestamp> timestamps; // of the values of sources[0]
+		std::vector<const double*> inputs;
+		std::vector<double> out;
+		double last = 0;
+		size_t dropped = 0; // values lost waiting for other sources
+		double wmGet() override { return last; }
+		double wmGetInput() override { return last; }
+		void wmSet(double) override {}
+		void wmSetMask(unsigned int, unsigned int) override {}
+	};
+
+	WatcherManager::WatcherManager(Gui& gui) : WatcherManager(new WatcherGuiTransport(gui), true)
+	{
+		this->gui = &gui;
+	}
+	WatcherManager::WatcherManager(WatcherTransport& transport) : WatcherManager(&transport, false)
+	{}
+	WatcherManager::WatcherManager(WatcherTransport* transport, bool ownsTransport) : pipe(std::string("watcherManager") + std::to_string((unsigned)this), 65536, true, true), transport(*transport), ownsTransport(ownsTransport)
+	{
+		// the smallest frames have room for a value and its RelTimestamp
+		static_assert(kMsgHeaderLength + sizeof(char) <= getRelTimestampsOffset(sizeof(char), sanitiseFrameSize(0, sizeof(char))), "char frames too small");
+		static_assert(kMsgHeaderLength + sizeof(char) <= getRelTimestampsOffset(sizeof(char), sanitiseFrameSize(16, sizeof(char))), "char frames too small");
+		static_assert(kMsgHeaderLength + sizeof(char) <= getRelTimestampsOffset(sizeof(char), sanitiseFrameSize(24, sizeof(char))), "char frames too small");
+		static_assert(kMsgHeaderLength + sizeof(float) <= getRelTimestampsOffset(sizeof(float), sanitiseFrameSize(0, sizeof(float))), "float frames too small");
+		static_assert(kMsgHeaderLength + sizeof(double) <= getRelTimestampsOffset(sizeof(double), sanitiseFrameSize(0, sizeof(double))), "double frames too small");
+		static_assert(sizeof(RelTimestamp) + getRelTimestampsOffset(sizeof(double), sanitiseFrameSize(0, sizeof(double))) <= sanitiseFrameSize(0, sizeof(double)), "double frames too small");
+		transport->setControlCallback([this](JSONObject& json) {
+			std::lock_guard<std::mutex> lock(controlMutex);
+			this->controlCallback(json);
 		});
+		monitorFrame.resize(kBufSize);
+		pipeSentNonRt = 0;
+		monitorBufferId = transport->registerBuffer('j', kBufSize);
 		pipe.setTimeoutMsNonRt(100);
 		shouldStop = false;
 		pipeToJsonThread = std::thread(&WatcherManager::pipeToJson, this);
+		replayThread = std::thread(&WatcherManager::replayDecode, this);
+		tapThread = std::thread(&WatcherManager::tapProcess, this);
 	};
 	WatcherManager::~WatcherManager()
 	{
+		transport.setControlCallback(nullptr);
 		shouldStop = true;
 		pipeToJsonThread.join();
+		replayThread.join();
+		tapThread.join();
+		for(auto r : replays)
+			cleanupReplay(r);
+		for(auto tap : taps)
+			cleanupTap(tap);
+		for(auto p : vec)
+		{
+			for(auto& stream : p->streams)
+				delete stream.buffer;
+		}
+		for(auto d : deriveds)
+			delete d;
+		for(auto buffer : bufferPool)
+			delete buffer;
+		delete batch;
+		if(ownsTransport)
+			delete &transport;
 	}
-	void WatcherManager::setup(float sampleRate)
+	void WatcherManager::setup(float sampleRate, size_t blockSize)
 	{
 		this->sampleRate = sampleRate;
+		this->blockSize = blockSize;
 	}
 	void WatcherManager::unreg(WatcherBase* that)
 	{
 		auto it = std::find_if(vec.begin(), vec.end(), [that](decltype(vec[0])& item){
 			return item->w == that;
 		});
+		// derived watchers can't outlive their sources
+		std::vector<Derived*> dependents;
+		{
+			std::lock_guard<std::mutex> lock(tapsMutex);
+			for(auto d : deriveds)
+			{
+				for(auto& source : d->sources)
+				{
+					if(source.priv == *it)
+					{
+						dependents.push_back(d);
+						break;
+					}
+				}
+			}
+		}
+		if(dependents.size())
+		{
+			for(auto d : dependents)
+				cleanupDerived(d, *it);
+			it = std::find_if(vec.begin(), vec.end(), [that](decltype(vec[0])& item){
+				return item->w == that;
+			});
+		}
 		cleanupLogger(*it);
+		{
+			std::lock_guard<std::mutex> lock(replaysMutex);
+			for(auto rit = replays.begin(); rit != replays.end();)
+			{
+				if((*rit)->priv == *it)
+				{
+					cleanupReplay(*rit);
+					rit = replays.erase(rit);
+				} else
+					++rit;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(tapsMutex);
+			auto tit = std::find(taps.begin(), taps.end(), (*it)->tap);
+			if(tit != taps.end())
+			{
+				cleanupTap(*tit);
+				taps.erase(tit);
+			}
+		}
+		// the RT thread is no longer using them
+		for(auto& stream : (*it)->streams)
+		{
+			if(stream.buffer)
+				putBuffer(stream.buffer);
+		}
 		// TODO: unregister from GUI
 		delete *it;
 		vec.erase(it);
@@ -145,19 +643,49 @@ WatcherManager* Bela_getDefaultWatcherManager()
 						sendJsonResponse(new JSONValue(watcher), WSServer::kThreadOther);
 					}
 						break;
+					case MsgToNrt::kCmdStartedReplaying:
+					case MsgToNrt::kCmdStoppedReplaying:
+					{
+						// control only ever changes with this held
+						std::lock_guard<std::mutex> controlLock(controlMutex);
+						std::lock_guard<std::mutex> lock(replaysMutex);
+						Replay* r = (Replay*)(uintptr_t)msg.args[1];
+						auto it = std::find(replays.begin(), replays.end(), r);
+						if(it == replays.end())
+							break; // already removed by unreg()
+						JSONObject watcher;
+						watcher[L"watcher"] = new JSONValue(JSON::s2ws(msg.priv->name));
+						watcher[L"replayFileName"] = new JSONValue(JSON::s2ws(r->fileName));
+						if(MsgToNrt::kCmdStartedReplaying == msg.cmd)
+							watcher[L"timestamp"] = new JSONValue(double(msg.args[0]));
+						else {
+							watcher[L"timestampEnd"] = new JSONValue(double(msg.args[0]));
+							if(r->tookControl)
+								stopControlling(r->priv);
+							cleanupReplay(r);
+							replays.erase(it);
+						}
+						sendJsonResponse(new JSONValue(watcher), WSServer::kThreadOther);
+					}
+						break;
+					case MsgToNrt::kCmdReleasedBuffer:
+						putBuffer((FrameBuffer*)(uintptr_t)msg.args[0]);
+						break;
+					case MsgToNrt::kCmdBatchDone:
+						delete (Batch*)(uintptr_t)msg.args[0];
+						break;
 					case MsgToNrt::kCmdNone:
 						break;
 				}
 			}
 		}
 	}
-	void WatcherManager::startWatching(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration) {
-		startStreamAtFor(p, kStreamIdxWatch, startTimestamp, duration);
-		// TODO: register guiBufferId here
+	void WatcherManager::startWatching(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration, size_t frameSize, FrameBuffer* buffer) {
+		// guiBufferId has been registered by the non-RT thread
+		startStreamAtFor(p, kStreamIdxWatch, startTimestamp, duration, frameSize, buffer);
 	}
 	void WatcherManager::stopWatching(Priv* p, AbsTimestamp timestampEnd) {
 		stopStreamAt(p, kStreamIdxWatch, timestampEnd);
-		// TODO: unregister guiBufferId here
 	}
 	void WatcherManager::startControlling(Priv* p) {
 		if(p->controlled)
@@ -171,9 +699,24 @@ WatcherManager* Bela_getDefaultWatcherManager()
 		p->controlled = false;
 		p->w->localControl(true);
 	}
-	void WatcherManager::startStreamAtFor(Priv* p, StreamIdx idx, AbsTimestamp startTimestamp, AbsTimestamp duration) {
+	void WatcherManager::startStreamAtFor(Priv* p, StreamIdx idx, AbsTimestamp startTimestamp, AbsTimestamp duration, size_t frameSize, FrameBuffer* buffer) {
 		Stream& stream = p->streams[idx];
+		// detach from any stream it shares frames with, as it
+		// will start a new frame of its own
+		splitFrame(p, idx);
+		for(auto& other : p->streams)
+			other.followers &= ~(1 << idx);
+		stream.following = false;
 		stream.state = kStreamStateStarting;
+		stream.count = 0;
+		// no allocation here: the buffer comes with the command and
+		// replaces any we were still holding
+		releaseBuffer(p, idx);
+		stream.buffer = buffer;
+		stream.v = buffer->data();
+		stream.frameSize = frameSize;
+		stream.relTimestampsOffset = getRelTimestampsOffset(p->typeSize, frameSize);
+		stream.maxCount = kTimestampBlock == p->timestampMode ? frameSize : stream.relTimestampsOffset - (p->typeSize - 1);
 		if(startTimestamp < timestamp)
 			startTimestamp = timestamp;
 		stream.schedTsStart = startTimestamp;
@@ -203,30 +746,71 @@ WatcherManager* Bela_getDefaultWatcherManager()
 		stream.schedTsStart = timestampEnd;
 		updateSometingToDo(p, true);
 	}
-	void WatcherManager::startLogging(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration) {
-		startStreamAtFor(p, kStreamIdxLog, startTimestamp, duration);
+	void WatcherManager::startLogging(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration, size_t frameSize, FrameBuffer* buffer) {
+		startStreamAtFor(p, kStreamIdxLog, startTimestamp, duration, frameSize, buffer);
 	}
 	void WatcherManager::stopLogging(Priv* p, AbsTimestamp timestamp) {
 		stopStreamAt(p, kStreamIdxLog, timestamp);
 	}
+	void WatcherManager::startReplaying(Priv* p, Replay* r, AbsTimestamp startTimestamp) {
+		if(p->replay)
+			stopReplaying(p);
+		if(startTimestamp < timestamp)
+			startTimestamp = timestamp;
+		r->startTimestamp = startTimestamp;
+		p->replay = r;
+		MsgToNrt msg {
+			.priv = p,
+			.cmd = MsgToNrt::kCmdStartedReplaying,
+			.args = {
+				startTimestamp,
+				(uintptr_t)r,
+			},
+		};
+		pipe.writeRt(msg);
+		updateSometingToDo(p, true);
+	}
+	void WatcherManager::stopReplaying(Priv* p) {
+		Replay* r = p->replay;
+		if(!r)
+			return;
+		// from now on the non-RT thread owns r and will delete it, and
+		// give control back if needed
+		p->replay = nullptr;
+		MsgToNrt msg {
+			.priv = p,
+			.cmd = MsgToNrt::kCmdStoppedReplaying,
+			.args = {
+				timestamp,
+				(uintptr_t)r,
+			},
+		};
+		pipe.writeRt(msg);
+		updateSometingToDo(p);
+	}
 	void WatcherManager::setMonitoring(Priv* p, size_t period) {
 		p->monitoring = (kMonitorChange | period);
 		p->somethingToDo = true; // TODO: race condition
 	}
-	void WatcherManager::setupLogger(Priv* p) {
+	void WatcherManager::setupLogger(Priv* p, size_t frameSize) {
 		cleanupLogger(p);
 		p->logger = new WriteFile((p->name + ".bin").c_str(), false, false);
 		p->logger->setFileType(kBinary);
 		p->logFileName = p->logger->getName();
+		std::vector<uint8_t> header = logHeader(p->name, p->type, frameSize);
+		p->logger->log((float*)(header.data()), header.size() / sizeof(float));
+	}
+
+	std::vector<uint8_t> WatcherManager::logHeader(const std::string& name, const std::string& type, size_t frameSize) {
 		std::vector<uint8_t> header;
 		// string fields first, null-separated
 		for(auto c : std::string("watcher"))
 			header.push_back(c);
 		header.push_back(0);
-		for(auto c : p->name)
+		for(auto c : name)
 			header.push_back(c);
 		header.push_back(0);
-		for(auto c : p->type)
+		for(auto c : type)
 			header.push_back(c);
 		header.push_back(0);
 		pid_t pid = getpid();
@@ -236,7 +820,14 @@ WatcherManager* Bela_getDefaultWatcherManager()
 		for(size_t n = 0; n < sizeof(ptr); ++n)
 			header.push_back(((uint8_t*)&ptr)[n]);
 		header.resize(((header.size() + 3) / 4) * 4); // round to nearest multiple of 4
-		p->logger->log((float*)(header.data()), header.size() / sizeof(float));
+		// version 1 ended here
+		uint32_t fields[] = { kLogHeaderMagic, kLogVersion, uint32_t(frameSize) };
+		for(auto field : fields)
+		{
+			for(size_t n = 0; n < sizeof(field); ++n)
+				header.push_back(((uint8_t*)&field)[n]);
+		}
+		return header;
 	}
 
 	void WatcherManager::cleanupLogger(Priv* p) {
@@ -247,6 +838,1122 @@ WatcherManager* Bela_getDefaultWatcherManager()
 		p->logger = nullptr;
 	}
 
+	WatcherManager::Replay* WatcherManager::setupReplay(Priv* p, const std::string& fileName) {
+		FILE* file = fopen(fileName.c_str(), "rb");
+		if(!file)
+		{
+			fprintf(stderr, "replay: unable to open %s\n", fileName.c_str());
+			return nullptr;
+		}
+		// parse the header written by logHeader(): three null-terminated
+		// strings, the pid and the pointer, padded to a multiple of 4.
+		// Since version 2, that is followed by kLogHeaderMagic, the
+		// version and the frame size
+		std::array<std::string,3> strings;
+		size_t headerSize = 0;
+		for(auto& str : strings)
+		{
+			int c;
+			while((c = fgetc(file)) > 0)
+				str += c;
+			headerSize += str.size() + 1;
+			if(c < 0)
+				break;
+		}
+		headerSize += sizeof(pid_t) + sizeof(this);
+		headerSize = ((headerSize + 3) / 4) * 4;
+		uint32_t fields[3] = {};
+		bool valid = !fseek(file, headerSize, SEEK_SET);
+		uint32_t frameSize = kBufSize; // all frames were this large in version 1
+		bool legacy = true;
+		if(valid && 1 == fread(fields, sizeof(fields), 1, file) && kLogHeaderMagic == fields[0])
+		{
+			legacy = false;
+			if(fields[1] > kLogVersion)
+				fprintf(stderr, "replay: %s is from a newer version (%u), trying anyway\n", fileName.c_str(), fields[1]);
+			frameSize = fields[2];
+			headerSize += sizeof(fields);
+		}
+		valid &= frameSize == sanitiseFrameSize(frameSize, p->typeSize);
+		if(kSpectrumLogType == strings[2])
+		{
+			fprintf(stderr, "replay: %s is a log of the spectrum of %s and cannot be replayed\n", fileName.c_str(), strings[1].c_str());
+			fclose(file);
+			return nullptr;
+		}
+		// a trailer is only there if the log was stopped, not if it
+		// was interrupted (and then all frames are full) or written by
+		// version 1
+		long dataEnd = -1;
+		uint32_t trailer[2] = {};
+		if(valid && !fseek(file, -long(sizeof(trailer)), SEEK_END) && 1 == fread(trailer, sizeof(trailer), 1, file))
+			dataEnd = ftell(file) - sizeof(trailer);
+		bool hasTrailer = kLogTrailerMagic == trailer[0] && dataEnd >= long(headerSize) && 0 == (dataEnd - headerSize) % frameSize;
+		if(!valid || "watcher" != strings[0] || p->type != strings[2] || fseek(file, headerSize, SEEK_SET))
+		{
+			fprintf(stderr, "replay: %s is not a valid log for watcher %s of type %s\n", fileName.c_str(), p->name.c_str(), p->type.c_str());
+			fclose(file);
+			return nullptr;
+		}
+		Replay* r = new Replay;
+		r->priv = p;
+		r->file = file;
+		r->fileName = fileName;
+		r->frame.resize(frameSize);
+		r->relTimestampsOffset = getRelTimestampsOffset(p->typeSize, frameSize);
+		r->lastNumValues = hasTrailer ? trailer[1] : 0;
+		r->dataEnd = hasTrailer ? dataEnd : -1;
+		r->legacy = legacy;
+		size_t ringSize = 4 * frameSize / p->typeSize; // a few frames' worth
+		if(ringSize < kReplayRingSize)
+			ringSize = kReplayRingSize;
+		r->ring.resize(ringSize);
+		r->writeIdx = 0;
+		r->readIdx = 0;
+		r->eof = false;
+		r->firstTimestamp = -1;
+		r->startTimestamp = -1;
+		// prefill so that the RT thread has something to start with
+		replayFill(r);
+		return r;
+	}
+
+	void WatcherManager::cleanupReplay(Replay* r) {
+		if(!r)
+			return;
+		if(r->file)
+			fclose(r->file);
+		delete r;
+	}
+
+	void WatcherManager::replayDecode()
+	{
+		while(!shouldStop)
+		{
+			{
+				std::lock_guard<std::mutex> lock(replaysMutex);
+				for(auto r : replays)
+					replayFill(r);
+			}
+			usleep(kReplayPollUs);
+		}
+	}
+
+	template <typename T>
+	void WatcherManager::replayDecodeFrame(Replay* r, size_t numValues)
+	{
+		const Priv* p = r->priv;
+		const unsigned char* data = r->frame.data();
+		AbsTimestamp frameTimestamp;
+		memcpy(&frameTimestamp, data, kMsgHeaderLength);
+		if(AbsTimestamp(-1) == r->firstTimestamp)
+			r->firstTimestamp = frameTimestamp;
+		const T* values = (const T*)(data + kMsgHeaderLength);
+		const RelTimestamp* relTimestamps = (const RelTimestamp*)(data + r->relTimestampsOffset);
+		if(kTimestampSample == p->timestampMode && r->legacy)
+		{
+			// version 1 doesn't say where the padding of the last
+			// frame starts: drop the values whose relative timestamp
+			// looks like part of it. Version 2 has a trailer for that
+			while(numValues > 1 && 0 == relTimestamps[numValues - 1])
+				--numValues;
+		}
+		size_t writeIdx = r->writeIdx.load(std::memory_order_relaxed);
+		for(size_t n = 0; n < numValues; ++n)
+		{
+			ReplayValue& rv = r->ring[writeIdx];
+			rv.timestamp = frameTimestamp - r->firstTimestamp;
+			if(kTimestampSample == p->timestampMode)
+				rv.timestamp += relTimestamps[n];
+			rv.value = values[n];
+			writeIdx = (writeIdx + 1) % r->ring.size();
+		}
+		r->writeIdx.store(writeIdx, std::memory_order_release);
+	}
+
+	void WatcherManager::replayFill(Replay* r)
+	{
+		const Priv* p = r->priv;
+		size_t numValues = kTimestampSample == p->timestampMode
+			? (r->relTimestampsOffset - kMsgHeaderLength) / p->typeSize
+			: (r->frame.size() - kMsgHeaderLength) / p->typeSize;
+		while(!r->eof.load(std::memory_order_relaxed))
+		{
+			size_t readIdx = r->readIdx.load(std::memory_order_acquire);
+			size_t writeIdx = r->writeIdx.load(std::memory_order_relaxed);
+			size_t space = (readIdx + r->ring.size() - writeIdx - 1) % r->ring.size();
+			if(space < numValues)
+				break;
+			if(r->dataEnd == ftell(r->file) || r->frame.size() != fread(r->frame.data(), 1, r->frame.size(), r->file))
+			{
+				r->eof.store(true, std::memory_order_release);
+				break;
+			}
+			// the last frame is zero-padded after the values
+			size_t frameNumValues = numValues;
+			if(r->dataEnd == ftell(r->file) && r->lastNumValues < numValues)
+				frameNumValues = r->lastNumValues;
+			switch(p->type[0])
+			{
+				case 'c': replayDecodeFrame<char>(r, frameNumValues); break;
+				case 'j': replayDecodeFrame<unsigned int>(r, frameNumValues); break;
+				case 'i': replayDecodeFrame<int>(r, frameNumValues); break;
+				case 'f': replayDecodeFrame<float>(r, frameNumValues); break;
+				case 'd': replayDecodeFrame<double>(r, frameNumValues); break;
+			}
+		}
+	}
+
+	// running statistics and histogram of the values of a watcher,
+	// updated by tapThread one frame at a time
+	struct WatcherManager::Stats {
+		uint64_t count;
+		double min;
+		double max;
+		double mean;
+		double m2; // sum of squared differences from the mean
+		double lo;
+		double hi;
+		bool logScale;
+		// lo and hi are taken from the first frame with finite values
+		// and widened to fit any that come later
+		bool autoRange;
+		bool hasRange;
+		std::vector<uint64_t> bins;
+		uint64_t underflow;
+		uint64_t overflow;
+		uint64_t binned; // values in bins, underflow and overflow
+		void setup(size_t numBins, double lo, double hi, bool logScale, bool autoRange)
+		{
+			bins.resize(numBins ? numBins : 1);
+			this->lo = lo;
+			this->hi = hi;
+			this->logScale = logScale;
+			this->autoRange = autoRange;
+			reset();
+		}
+		void reset()
+		{
+			count = 0;
+			min = HUGE_VAL;
+			max = -HUGE_VAL;
+			mean = 0;
+			m2 = 0;
+			std::fill(bins.begin(), bins.end(), 0);
+			underflow = 0;
+			overflow = 0;
+			binned = 0;
+			hasRange = !autoRange;
+		}
+		template <typename T>
+		void update(const T* values, size_t n)
+		{
+			if(!n)
+				return;
+			// NaNs fail the comparisons and are left out
+			double blockMin = HUGE_VAL;
+			double blockMax = -HUGE_VAL;
+			double sum = 0;
+			for(size_t i = 0; i < n; ++i)
+			{
+				double x = values[i];
+				blockMin = x < blockMin ? x : blockMin;
+				blockMax = x > blockMax ? x : blockMax;
+				sum += x;
+			}
+			double blockMean = sum / n;
+			double blockM2 = 0;
+			for(size_t i = 0; i < n; ++i)
+			{
+				double d = values[i] - blockMean;
+				blockM2 += d * d;
+			}
+			// merge with what we have so far (Chan et al.)
+			uint64_t total = count + n;
+			double delta = blockMean - mean;
+			mean += delta * n / total;
+			m2 += blockM2 + delta * delta * (double(count) * n / total);
+			count = total;
+			min = std::min(min, blockMin);
+			max = std::max(max, blockMax);
+			if(autoRange)
+				fitRange(values, n);
+			// until then, values only count towards the above
+			if(hasRange)
+				histogram(values, n);
+		}
+		// in the domain of the bins
+		double toBin(double x) const
+		{
+			return logScale ? log(x) : x;
+		}
+		double fromBin(double x) const
+		{
+			return logScale ? exp(x) : x;
+		}
+		template <typename T>
+		void fitRange(const T* values, size_t n)
+		{
+			// non-positive values can't be placed on a log scale and
+			// NaNs and infinities nowhere: they are left to histogram()
+			double first = HUGE_VAL;
+			double last = -HUGE_VAL;
+			for(size_t i = 0; i < n; ++i)
+			{
+				double x = values[i];
+				if(!std::isfinite(x) || (logScale && x <= 0))
+					continue;
+				first = std::min(first, x);
+				last = std::max(last, x);
+			}
+			if(first > last)
+				return;
+			double a = toBin(first);
+			double b = toBin(last);
+			if(!hasRange)
+			{
+				// all bins are empty: any range will do, as long as
+				// the largest value isn't on hi, which is excluded
+				if(b <= a)
+					b = a + std::max(1.0, fabs(a));
+				else
+					b += (b - a) / bins.size();
+				lo = fromBin(a);
+				hi = fromBin(b);
+				hasRange = true;
+				return;
+			}
+			// double the range until it fits, merging pairs of bins
+			// so that the counts so far stay where they were
+			double start = toBin(lo);
+			double end = toBin(hi);
+			if(a >= start && b < end)
+				return;
+			size_t size = bins.size();
+			while(a < start || b >= end)
+			{
+				double span = end - start;
+				if(!std::isfinite(2 * span))
+					break;
+				if(b >= end)
+				{
+					// old bin k goes to k / 2
+					for(size_t k = 0; k < size; ++k)
+						bins[k] = 2 * k < size ? bins[2 * k] + (2 * k + 1 < size ? bins[2 * k + 1] : 0) : 0;
+					end = start + 2 * span;
+				} else {
+					// old bin k goes to (size + k) / 2
+					for(size_t k = size; k-- > 0;)
+						bins[k] = 2 * k + 1 >= size ? (2 * k >= size ? bins[2 * k - size] : 0) + bins[2 * k + 1 - size] : 0;
+					start = end - 2 * span;
+				}
+			}
+			lo = fromBin(start);
+			hi = fromBin(end);
+		}
+		template <typename T>
+		void histogram(const T* values, size_t n)
+		{
+			double offset = toBin(lo);
+			double scale = bins.size() / (toBin(hi) - offset);
+			for(size_t i = 0; i < n; ++i)
+			{
+				double x = values[i];
+				if(logScale)
+					x = x > 0 ? log(x) : -HUGE_VAL;
+				double pos = (x - offset) * scale;
+				// NaN fails all of these and is left out
+				if(pos < 0)
+					underflow++;
+				else if(pos >= bins.size())
+					overflow++;
+				else if(pos >= 0)
+					bins[size_t(pos)]++;
+				else
+					continue;
+				binned++;
+			}
+		}
+		// approximate: interpolates linearly within the bin. Only counts
+		// the values that made it to the histogram
+		double percentile(double p) const
+		{
+			double target = p / 100 * binned;
+			double acc = underflow;
+			if(!binned || target <= acc)
+				return min;
+			for(size_t n = 0; n < bins.size(); ++n)
+			{
+				if(bins[n] && acc + bins[n] >= target)
+				{
+					double pos = (n + (target - acc) / bins[n]) / bins.size();
+					double value = logScale ? lo * pow(hi / lo, pos) : lo + pos * (hi - lo);
+					return std::max(min, std::min(max, value));
+				}
+				acc += bins[n];
+			}
+			return max;
+		}
+	};
+
+	// windowed magnitude spectra of the values of a watcher, computed by
+	// tapThread every hop values and averaged (or peak-held) over
+	// `averages` transforms before being sent as one frame:
+	// an AbsTimestamp (that of the latest value in the window), a Header
+	// and size / 2 + 1 float magnitudes, normalised so that a full-scale
+	// sinusoid centred on a bin reads 1
+	struct WatcherManager::Spectrum {
+		enum Window {
+			kWindowRect,
+			kWindowHann,
+			kWindowHamming,
+			kWindowBlackman,
+			kWindowNum,
+		};
+		static constexpr const char* windowNames[kWindowNum] = { "rect", "hann", "hamming", "blackman" };
+		static constexpr uint32_t kFlagPeak = 1 << 0;
+		struct Header {
+			uint32_t size;
+			uint32_t hop;
+			uint32_t averages;
+			uint32_t flags; // kFlag*, and the Window in bits 8 to 15
+		};
+		size_t size;
+		size_t hop;
+		size_t averages;
+		bool peak;
+		Window windowType;
+		std::vector<float> window;
+		float gain;
+		std::vector<float> history; // the latest size values
+		size_t historyIdx;
+		size_t filled;
+		size_t sinceLast;
+		std::vector<std::complex<float>> bins;
+		std::vector<std::complex<float>> twiddles;
+		std::vector<uint32_t> reversed;
+		std::vector<float> acc;
+		size_t accCount;
+		std::vector<unsigned char> frame;
+		size_t dropped = 0; // input frames the tap lost since we started
+		size_t tapDropped = 0; // the tap's count when we last looked
+		WriteFile* logger = nullptr;
+		std::string logFileName;
+		~Spectrum()
+		{
+			if(logger)
+			{
+				logger->cleanup(false);
+				delete logger;
+			}
+		}
+		static size_t sanitiseSize(size_t size)
+		{
+			// a power of two in the supported range
+			size_t ret = 16;
+			while(ret < size && ret < kSpectrumMaxSize)
+				ret <<= 1;
+			return ret;
+		}
+		static Window findWindow(const std::string& name)
+		{
+			for(size_t n = 0; n < kWindowNum; ++n)
+			{
+				if(name == windowNames[n])
+					return Window(n);
+			}
+			return kWindowHann;
+		}
+		static size_t frameSize(size_t size)
+		{
+			return kMsgHeaderLength + sizeof(Header) + (size / 2 + 1) * sizeof(float);
+		}
+		void setup(size_t size, size_t hop, size_t averages, bool peak, Window windowType)
+		{
+			this->size = size;
+			this->hop = hop < 1 ? 1 : (hop > size ? size : hop);
+			this->averages = averages < 1 ? 1 : averages;
+			this->peak = peak;
+			this->windowType = windowType;
+			window.resize(size);
+			double sum = 0;
+			for(size_t n = 0; n < size; ++n)
+			{
+				double x = 2 * M_PI * n / size; // periodic windows
+				double w = 1;
+				switch(windowType)
+				{
+					case kWindowHann: w = 0.5 - 0.5 * cos(x); break;
+					case kWindowHamming: w = 0.54 - 0.46 * cos(x); break;
+					case kWindowBlackman: w = 0.42 - 0.5 * cos(x) + 0.08 * cos(2 * x); break;
+					default: break;
+				}
+				window[n] = w;
+				sum += w;
+			}
+			gain = 1 / sum;
+			history.assign(size, 0);
+			historyIdx = 0;
+			filled = 0;
+			sinceLast = 0;
+			bins.resize(size);
+			twiddles.resize(size / 2);
+			for(size_t n = 0; n < twiddles.size(); ++n)
+				twiddles[n] = std::polar(1.0, -2 * M_PI * n / size);
+			reversed.resize(size);
+			unsigned int bits = 0;
+			while((size_t(1) << bits) < size)
+				++bits;
+			for(size_t n = 0; n < size; ++n)
+			{
+				uint32_t r = 0;
+				for(unsigned int b = 0; b < bits; ++b)
+					r |= ((n >> b) & 1) << (bits - 1 - b);
+				reversed[n] = r;
+			}
+			acc.assign(size / 2 + 1, 0);
+			accCount = 0;
+			frame.resize(frameSize(size));
+			Header header = {
+				.size = uint32_t(size),
+				.hop = uint32_t(this->hop),
+				.averages = uint32_t(this->averages),
+				.flags = (peak ? kFlagPeak : 0) | (uint32_t(windowType) << 8),
+			};
+			memcpy(frame.data() + kMsgHeaderLength, &header, sizeof(header));
+		}
+		// returns true when frame holds a new spectrum
+		bool push(float value, AbsTimestamp timestamp)
+		{
+			history[historyIdx] = value;
+			historyIdx = (historyIdx + 1) & (size - 1);
+			++sinceLast;
+			if(filled < size)
+				++filled;
+			if(filled < size || sinceLast < hop)
+				return false;
+			sinceLast = 0;
+			transform();
+			if(++accCount < averages)
+				return false;
+			float* out = (float*)(frame.data() + kMsgHeaderLength + sizeof(Header));
+			float scale = peak ? 1 : 1.f / accCount;
+			for(size_t n = 0; n < acc.size(); ++n)
+				out[n] = acc[n] * scale;
+			memcpy(frame.data(), &timestamp, kMsgHeaderLength);
+			std::fill(acc.begin(), acc.end(), 0);
+			accCount = 0;
+			return true;
+		}
+		// iterative radix-2 FFT of the windowed history, oldest value
+		// first, accumulated into acc
+		void transform()
+		{
+			for(size_t n = 0; n < size; ++n)
+				bins[reversed[n]] = history[(historyIdx + n) & (size - 1)] * window[n];
+			for(size_t len = 2; len <= size; len <<= 1)
+			{
+				size_t half = len / 2;
+				size_t step = size / len;
+				for(size_t i = 0; i < size; i += len)
+				{
+					for(size_t j = 0; j < half; ++j)
+					{
+						std::complex<float> u = bins[i + j];
+						std::complex<float> v = bins[i + j + half] * twiddles[j * step];
+						bins[i + j] = u + v;
+						bins[i + j + half] = u - v;
+					}
+				}
+			}
+			for(size_t n = 0; n < acc.size(); ++n)
+			{
+				// single-sided: all bins but DC and Nyquist are doubled
+				float mag = std::abs(bins[n]) * gain * ((0 == n || size / 2 == n) ? 1 : 2);
+				acc[n] = peak ? std::max(acc[n], mag) : acc[n] + mag;
+			}
+		}
+	};
+	constexpr const char* WatcherManager::Spectrum::windowNames[];
+
+	WatcherManager::Tap* WatcherManager::setupTap(Priv* p) {
+		// should be called with tapsMutex held
+		if(p->tap)
+			return p->tap;
+		Tap* tap = new Tap;
+		tap->priv = p;
+		tap->frames.resize(kTapQueueLength);
+		for(auto& frame : tap->frames)
+			frame.v.resize(p->maxFrameSize);
+		tap->writeIdx = 0;
+		tap->readIdx = 0;
+		tap->dropped = 0;
+		tap->processed = 0;
+		tap->stats = nullptr;
+		tap->spectrum = nullptr;
+		taps.push_back(tap);
+		// only read by the RT thread after it receives kCmdStartTap
+		p->tap = tap;
+		return tap;
+	}
+
+	WatcherManager::FrameBuffer* WatcherManager::getBuffer(size_t size) {
+		std::lock_guard<std::mutex> lock(buffersMutex);
+		// smallest pooled buffer that is large enough
+		auto best = bufferPool.end();
+		for(auto it = bufferPool.begin(); it != bufferPool.end(); ++it)
+		{
+			if((*it)->size() >= size && (best == bufferPool.end() || (*it)->size() < (*best)->size()))
+				best = it;
+		}
+		FrameBuffer* buffer;
+		if(best != bufferPool.end())
+		{
+			buffer = *best;
+			bufferPool.erase(best);
+		} else {
+			// operator new aligns for any fundamental type, so the
+			// values after the 8-byte header are aligned, too
+			buffer = new FrameBuffer(size);
+		}
+		bufferBytesInUse += buffer->size();
+		return buffer;
+	}
+
+	void WatcherManager::putBuffer(FrameBuffer* buffer) {
+		if(!buffer)
+			return;
+		std::lock_guard<std::mutex> lock(buffersMutex);
+		bufferBytesInUse -= buffer->size();
+		bufferPool.push_back(buffer);
+	}
+
+	bool WatcherManager::tapHasConsumers(const Tap* tap) const {
+		return tap && (tap->stats || tap->spectrum || !tap->derived.empty());
+	}
+
+	void WatcherManager::cleanupTap(Tap* tap) {
+		if(!tap)
+			return;
+		delete tap->stats;
+		delete tap->spectrum;
+		delete tap;
+	}
+
+	void WatcherManager::tapProcess()
+	{
+		while(!shouldStop)
+		{
+			{
+				std::lock_guard<std::mutex> lock(tapsMutex);
+				for(auto tap : taps)
+				{
+					size_t readIdx = tap->readIdx.load(std::memory_order_relaxed);
+					while(readIdx != tap->writeIdx.load(std::memory_order_acquire))
+					{
+						tapProcessFrame(tap, tap->frames[readIdx]);
+						tap->processed++;
+						readIdx = (readIdx + 1) % tap->frames.size();
+						tap->readIdx.store(readIdx, std::memory_order_release);
+					}
+				}
+			}
+			usleep(kTapPollUs);
+		}
+	}
+
+	void WatcherManager::tapProcessFrame(Tap* tap, const TapFrame& frame)
+	{
+		const Priv* p = tap->priv;
+		const unsigned char* values = frame.v.data() + kMsgHeaderLength;
+		if(tap->stats)
+		{
+			switch(p->type[0])
+			{
+				case 'c': tap->stats->update((const char*)values, frame.numValues); break;
+				case 'j': tap->stats->update((const unsigned int*)values, frame.numValues); break;
+				case 'i': tap->stats->update((const int*)values, frame.numValues); break;
+				case 'f': tap->stats->update((const float*)values, frame.numValues); break;
+				case 'd': tap->stats->update((const double*)values, frame.numValues); break;
+			}
+		}
+		if(tap->spectrum)
+		{
+			switch(p->type[0])
+			{
+				case 'c': spectrumProcessFrame<char>(tap, frame); break;
+				case 'j': spectrumProcessFrame<unsigned int>(tap, frame); break;
+				case 'i': spectrumProcessFrame<int>(tap, frame); break;
+				case 'f': spectrumProcessFrame<float>(tap, frame); break;
+				case 'd': spectrumProcessFrame<double>(tap, frame); break;
+			}
+		}
+		for(auto d : tap->derived)
+		{
+			switch(p->type[0])
+			{
+				case 'c': derivedPush<char>(d, p, frame); break;
+				case 'j': derivedPush<unsigned int>(d, p, frame); break;
+				case 'i': derivedPush<int>(d, p, frame); break;
+				case 'f': derivedPush<float>(d, p, frame); break;
+				case 'd': derivedPush<double>(d, p, frame); break;
+			}
+			derivedRun(d);
+		}
+	}
+
+	template <typename T>
+	void WatcherManager::spectrumProcessFrame(Tap* tap, const TapFrame& frame)
+	{
+		const Priv* p = tap->priv;
+		Spectrum& s = *tap->spectrum;
+		size_t tapDropped = tap->dropped.load(std::memory_order_relaxed);
+		s.dropped += tapDropped - s.tapDropped;
+		s.tapDropped = tapDropped;
+		AbsTimestamp frameTimestamp;
+		memcpy(&frameTimestamp, frame.v.data(), kMsgHeaderLength);
+		const T* values = (const T*)(frame.v.data() + kMsgHeaderLength);
+		const RelTimestamp* relTimestamps = nullptr;
+		if(kTimestampSample == p->timestampMode)
+			relTimestamps = (const RelTimestamp*)(frame.v.data() + getRelTimestampsOffset(p->typeSize, frame.size));
+		for(size_t n = 0; n < frame.numValues; ++n)
+		{
+			// in kTimestampBlock mode we assume one value per sample,
+			// which is what spectra are mostly useful for
+			AbsTimestamp timestamp = frameTimestamp + (relTimestamps ? relTimestamps[n] : n);
+			if(!s.push(values[n], timestamp))
+				continue;
+			sendNonRt(p->spectrumBufferId, 'f', s.frame.data(), s.frame.size());
+			if(s.logger)
+				s.logger->log((float*)s.frame.data(), s.frame.size() / sizeof(float));
+		}
+	}
+
+	void WatcherManager::sendNonRt(unsigned int bufferId, char type, const void* data, size_t size)
+	{
+		// from any non-RT thread: the transport keeps it from
+		// interleaving with the frames of the RT thread
+		if(transport.numActiveConnections())
+			transport.sendBufferNonRt(bufferId, data, size, type);
+	}
+
+	void WatcherManager::sendSpectrumResponse(Priv* p)
+	{
+		// should be called with tapsMutex held
+		JSONObject watcher;
+		watcher[L"watcher"] = new JSONValue(JSON::s2ws(p->name));
+		if(p->tap && p->tap->spectrum)
+		{
+			const Spectrum& s = *p->tap->spectrum;
+			JSONObject spectrum;
+			spectrum[L"size"] = new JSONValue(int(s.size));
+			spectrum[L"hop"] = new JSONValue(int(s.hop));
+			spectrum[L"averages"] = new JSONValue(int(s.averages));
+			spectrum[L"window"] = new JSONValue(JSON::s2ws(Spectrum::windowNames[s.windowType]));
+			spectrum[L"peak"] = new JSONValue(s.peak);
+			spectrum[L"bufferId"] = new JSONValue(int(p->spectrumBufferId));
+			spectrum[L"frameSize"] = new JSONValue(int(s.frame.size()));
+			spectrum[L"logFileName"] = new JSONValue(JSON::s2ws(s.logFileName));
+			spectrum[L"framesDropped"] = new JSONValue(double(s.dropped));
+			watcher[L"spectrum"] = new JSONValue(spectrum);
+		}
+		sendJsonResponse(new JSONValue(watcher), WSServer::kThreadCallback);
+	}
+
+	void WatcherManager::sendStats(Priv* p, const std::vector<double>& percentiles)
+	{
+		// should be called with tapsMutex held
+		JSONObject watcher;
+		watcher[L"watcher"] = new JSONValue(JSON::s2ws(p->name));
+		if(p->tap && p->tap->stats)
+		{
+			const Stats& s = *p->tap->stats;
+			JSONObject stats;
+			stats[L"count"] = new JSONValue(double(s.count));
+			stats[L"min"] = new JSONValue(s.count ? s.min : 0);
+			stats[L"max"] = new JSONValue(s.count ? s.max : 0);
+			stats[L"mean"] = new JSONValue(s.mean);
+			stats[L"variance"] = new JSONValue(s.count > 1 ? s.m2 / (s.count - 1) : 0);
+			stats[L"lo"] = new JSONValue(s.lo);
+			stats[L"hi"] = new JSONValue(s.hi);
+			stats[L"scale"] = new JSONValue(JSON::s2ws(s.logScale ? "log" : "lin"));
+			JSONArray bins;
+			for(auto& bin : s.bins)
+				bins.emplace_back(new JSONValue(double(bin)));
+			stats[L"bins"] = new JSONValue(bins);
+			stats[L"underflow"] = new JSONValue(double(s.underflow));
+			stats[L"overflow"] = new JSONValue(double(s.overflow));
+			JSONArray ps;
+			JSONArray values;
+			for(auto& percentile : percentiles)
+			{
+				ps.emplace_back(new JSONValue(percentile));
+				values.emplace_back(new JSONValue(s.percentile(percentile)));
+			}
+			stats[L"percentiles"] = new JSONValue(ps);
+			stats[L"percentileValues"] = new JSONValue(values);
+			stats[L"framesProcessed"] = new JSONValue(double(p->tap->processed));
+			stats[L"framesDropped"] = new JSONValue(double(p->tap->dropped));
+			watcher[L"stats"] = new JSONValue(stats);
+		}
+		sendJsonResponse(new JSONValue(watcher), WSServer::kThreadCallback);
+	}
+
+	WatcherManager::Priv* WatcherManager::setupDerived(const std::string& name, const std::string& expression, std::string& error)
+	{
+		if(findPrivByName(name))
+		{
+			error = "a watcher with this name already exists";
+			return nullptr;
+		}
+		Derived* d = new Derived;
+		d->expression = expression;
+		if(!d->compiled.compile(expression))
+		{
+			error = d->compiled.error;
+			delete d;
+			return nullptr;
+		}
+		for(auto& sourceName : d->compiled.names)
+		{
+			Priv* source = findPrivByName(sourceName);
+			if(!source || source->derived)
+			{
+				error = "no watcher named " + sourceName;
+				if(source)
+					error += " that isn't itself derived";
+				delete d;
+				return nullptr;
+			}
+			d->sources.push_back({source, {}});
+		}
+		d->inputs.resize(d->sources.size());
+		Priv* p = (Priv*)doReg(d, name, d->sources[0].priv->timestampMode, typeid(double).name(), sizeof(double), kDefaultFrameSize);
+		p->derived = d;
+		d->priv = p;
+		std::vector<MsgToRt> msgs;
+		{
+			std::lock_guard<std::mutex> lock(tapsMutex);
+			for(auto& source : d->sources)
+			{
+				Tap* tap = setupTap(source.priv);
+				if(!tapHasConsumers(tap))
+				{
+					msgs.push_back(MsgToRt {
+						.priv = source.priv,
+						.cmd = MsgToRt::kCmdStartTap,
+						.args = {
+							0,
+							0,
+							source.priv->maxFrameSize,
+							(uintptr_t)getBuffer(source.priv->maxFrameSize),
+						},
+					});
+				}
+				tap->derived.push_back(d);
+			}
+			deriveds.push_back(d);
+		}
+		sendCommands(msgs);
+		return p;
+	}
+
+	void WatcherManager::cleanupDerived(Derived* d, const Priv* unregistering)
+	{
+		std::vector<MsgToRt> msgs;
+		{
+			std::lock_guard<std::mutex> lock(tapsMutex);
+			for(auto& source : d->sources)
+			{
+				Tap* tap = source.priv->tap;
+				tap->derived.erase(std::remove(tap->derived.begin(), tap->derived.end(), d), tap->derived.end());
+				// a source being unregistered is about to be deleted:
+				// the RT thread mustn't get any command for it, and
+				// unreg() takes care of its tap
+				if(source.priv != unregistering && !tapHasConsumers(tap))
+				{
+					msgs.push_back(MsgToRt {
+						.priv = source.priv,
+						.cmd = MsgToRt::kCmdStopTap,
+						.args = {
+							0,
+						},
+					});
+				}
+			}
+			for(size_t n = 0; n < kStreamIdxNum; ++n)
+				derivedStop(d->priv, StreamIdx(n));
+			deriveds.erase(std::find(deriveds.begin(), deriveds.end(), d));
+		}
+		sendCommands(msgs);
+		unreg(d);
+		delete d;
+	}
+
+	template <typename T>
+	void WatcherManager::derivedPush(Derived* d, const Priv* source, const TapFrame& frame)
+	{
+		// should be called from tapThread
+		const T* values = (const T*)(frame.v.data() + kMsgHeaderLength);
+		for(size_t k = 0; k < d->sources.size(); ++k)
+		{
+			Derived::Source& s = d->sources[k];
+			if(s.priv != source)
+				continue;
+			s.values.insert(s.values.end(), values, values + frame.numValues);
+			if(0 == k)
+			{
+				AbsTimestamp frameTimestamp;
+				memcpy(&frameTimestamp, frame.v.data(), kMsgHeaderLength);
+				const RelTimestamp* relTimestamps = nullptr;
+				if(kTimestampSample == source->timestampMode)
+					relTimestamps = (const RelTimestamp*)(frame.v.data() + getRelTimestampsOffset(source->typeSize, frame.size));
+				// in kTimestampBlock mode we assume one value per sample
+				for(size_t n = 0; n < frame.numValues; ++n)
+					d->timestamps.push_back(frameTimestamp + (relTimestamps ? relTimestamps[n] : n));
+			}
+			if(s.values.size() > kDerivedMaxPending)
+			{
+				// the others have fallen too far behind: keep the latest
+				size_t excess = s.values.size() - kDerivedMaxPending;
+				s.values.erase(s.values.begin(), s.values.begin() + excess);
+				if(0 == k)
+					d->timestamps.erase(d->timestamps.begin(), d->timestamps.begin() + excess);
+				d->dropped += excess;
+			}
+		}
+	}
+
+	void WatcherManager::derivedRun(Derived* d)
+	{
+		// should be called from tapThread
+		size_t n = d->timestamps.size();
+		for(auto& s : d->sources)
+			n = std::min(n, s.values.size());
+		if(!n)
+			return;
+		for(size_t k = 0; k < d->sources.size(); ++k)
+			d->inputs[k] = d->sources[k].values.data();
+		if(d->out.size() < n)
+			d->out.resize(n);
+		d->compiled.evaluate(d->inputs, n, d->out.data());
+		Priv* p = d->priv;
+		for(size_t k = 0; k < kStreamIdxNum; ++k)
+		{
+			if(kStreamStateNo == p->streams[k].state)
+				continue;
+			for(size_t i = 0; i < n; ++i)
+				derivedWrite(p, StreamIdx(k), d->out[i], d->timestamps[i]);
+		}
+		// as in notify(), one value at a time, but only the latest
+		// value that is due is sent
+		bool active = transport.numActiveConnections();
+		size_t due = n;
+		for(size_t i = 0; i < n && kMonitorDont != p->monitoring; ++i)
+		{
+			if(p->monitoring & kMonitorChange)
+			{
+				p->monitoring &= ~kMonitorChange; // reset flag
+				if(p->monitoring)
+					p->monitoringNext = d->timestamps[i];
+				else
+					p->monitoringNext = -1;
+			}
+			if(d->timestamps[i] >= p->monitoringNext)
+			{
+				if(active)
+					due = i;
+				if(1 == p->monitoring)
+				{
+					// one-shot
+					p->monitoring = kMonitorChange | 0;
+				} else
+					p->monitoringNext = d->timestamps[i] + p->monitoring;
+			}
+		}
+		if(due < n)
+		{
+			// same layout as the frames of monitorAppend()
+			uint32_t frame[5];
+			memcpy(frame, &d->timestamps[due], kMsgHeaderLength);
+			frame[2] = p->id;
+			memcpy(frame + 3, &d->out[due], sizeof(double));
+			sendNonRt(monitorBufferId, 'j', frame, sizeof(frame));
+		}
+		d->last = d->out[n - 1];
+		for(auto& s : d->sources)
+			s.values.erase(s.values.begin(), s.values.begin() + n);
+		d->timestamps.erase(d->timestamps.begin(), d->timestamps.begin() + n);
+	}
+
+	// handles the commands on derived watchers that other watchers pass
+	// on to the RT thread. Returns false if the command isn't supported.
+	bool WatcherManager::derivedCommand(Priv* p, const std::string& cmd, AbsTimestamp timestamp, AbsTimestamp duration, size_t frameSize)
+	{
+		StreamIdx idx = ("watch" == cmd || "unwatch" == cmd) ? kStreamIdxWatch : kStreamIdxLog;
+		Stream& stream = p->streams[idx];
+		std::lock_guard<std::mutex> lock(tapsMutex);
+		if("watch" == cmd || "log" == cmd)
+		{
+			if("log" == cmd && isStreaming(p, kStreamIdxLog))
+				return true;
+			derivedStop(p, idx);
+			if("watch" == cmd && kNoGuiBufferId == p->guiBufferId)
+				p->guiBufferId = transport.registerBuffer(p->type[0], p->maxFrameSize);
+			if("log" == cmd)
+				setupLogger(p, frameSize);
+			stream.buffer = getBuffer(frameSize);
+			stream.v = stream.buffer->data();
+			stream.count = 0;
+			stream.frameSize = frameSize;
+			stream.relTimestampsOffset = getRelTimestampsOffset(p->typeSize, frameSize);
+			stream.maxCount = kTimestampBlock == p->timestampMode ? frameSize : stream.relTimestampsOffset - (p->typeSize - 1);
+			stream.schedTsStart = timestamp;
+			stream.schedTsEnd = duration ? timestamp + duration : -1;
+			stream.state = kStreamStateYes;
+			if("log" == cmd)
+			{
+				JSONObject watcher;
+				watcher[L"watcher"] = new JSONValue(JSON::s2ws(p->name));
+				watcher[L"logFileName"] = new JSONValue(JSON::s2ws(p->logFileName));
+				watcher[L"timestamp"] = new JSONValue(double(timestamp));
+				watcher[L"timestampEnd"] = new JSONValue(double(stream.schedTsEnd));
+				sendJsonResponse(new JSONValue(watcher), WSServer::kThreadCallback);
+			}
+			return true;
+		}
+		if("unwatch" == cmd || "unlog" == cmd)
+		{
+			if(timestamp)
+				stream.schedTsEnd = timestamp;
+			else
+				derivedStop(p, idx);
+			return true;
+		}
+		return false;
+	}
+
+	void WatcherManager::derivedWrite(Priv* p, StreamIdx idx, double value, AbsTimestamp timestamp)
+	{
+		// the non-RT counterpart of streamValue(), should be called
+		// with tapsMutex held
+		Stream& stream = p->streams[idx];
+		if(kStreamStateNo == stream.state || timestamp < stream.schedTsStart)
+			return;
+		if(timestamp >= stream.schedTsEnd)
+			return derivedStop(p, idx);
+		if(0 == stream.count)
+		{
+			memcpy(stream.v, &timestamp, kMsgHeaderLength);
+			stream.firstTimestamp = timestamp;
+			stream.count = kMsgHeaderLength;
+			stream.countRelTimestamps = stream.relTimestampsOffset;
+		}
+		memcpy(stream.v + stream.count, &value, sizeof(value));
+		stream.count += sizeof(value);
+		bool full = stream.count >= stream.maxCount;
+		if(kTimestampSample == p->timestampMode)
+		{
+			RelTimestamp relTimestamp = timestamp - stream.firstTimestamp;
+			memcpy(stream.v + stream.countRelTimestamps, &relTimestamp, sizeof(relTimestamp));
+			stream.countRelTimestamps += sizeof(relTimestamp);
+			full |= (stream.count >= stream.relTimestampsOffset || stream.countRelTimestamps >= stream.frameSize);
+		}
+		if(full)
+			derivedEndFrame(p, idx, true);
+	}
+
+	void WatcherManager::derivedEndFrame(Priv* p, StreamIdx idx, bool full)
+	{
+		Stream& stream = p->streams[idx];
+		if(!stream.count)
+			return;
+		if(!full)
+		{
+			// zero-padded as in endFrame()
+			if(kTimestampSample == p->timestampMode)
+			{
+				memset(stream.v + stream.count, 0, stream.relTimestampsOffset - stream.count);
+				memset(stream.v + stream.countRelTimestamps, 0, stream.frameSize - stream.countRelTimestamps);
+			} else
+				memset(stream.v + stream.count, 0, stream.frameSize - stream.count);
+		}
+		if(kStreamIdxWatch == idx)
+			sendNonRt(p->guiBufferId, p->type[0], stream.v, stream.frameSize);
+		if(kStreamIdxLog == idx)
+			p->logger->log((float*)stream.v, stream.frameSize / sizeof(float));
+		stream.count = 0;
+	}
+
+	void WatcherManager::derivedStop(Priv* p, StreamIdx idx)
+	{
+		Stream& stream = p->streams[idx];
+		if(kStreamStateNo == stream.state)
+			return;
+		size_t numValues = stream.count ? (stream.count - kMsgHeaderLength) / sizeof(double) : 0;
+		derivedEndFrame(p, idx, false);
+		if(kStreamIdxLog == idx)
+		{
+			if(numValues)
+				logTrailer(p, numValues);
+			p->logger->requestFlush();
+		}
+		stream.state = kStreamStateNo;
+		stream.schedTsEnd = -1;
+		putBuffer(stream.buffer);
+		stream.buffer = nullptr;
+		stream.v = nullptr;
+	}
+
+	void WatcherManager::sendCommands(std::vector<MsgToRt>& msgs)
+	{
+		// consecutive start commands with the same timestamp go in one
+		// Batch, so that the RT thread gets a single message for them
+		// and they all take effect at the same time
+		size_t numSent = 0;
+		for(size_t n = 0; n < msgs.size();)
+		{
+			size_t end = n + 1;
+			if(msgs[n].isTimedStart())
+			{
+				while(end < msgs.size() && msgs[end].isTimedStart() && msgs[end].args[0] == msgs[n].args[0])
+					++end;
+			}
+			Batch* b = nullptr;
+			MsgToRt msg = msgs[n];
+			if(end - n > 1)
+			{
+				b = new Batch;
+				b->msgs.assign(msgs.begin() + n, msgs.begin() + end);
+				b->next = 0;
+				msg = MsgToRt {
+					.priv = nullptr,
+					.cmd = MsgToRt::kCmdBatch,
+					.args = {
+						(uintptr_t)b,
+					},
+				};
+			}
+			if(1 == pipe.writeNonRt(msg))
+				numSent++;
+			else {
+				fprintf(stderr, "Watcher: unable to send %u commands to the audio thread\n", unsigned(end - n));
+				for(size_t k = n; k < end; ++k)
+				{
+					MsgToRt::Cmd cmd = msgs[k].cmd;
+					if(MsgToRt::kCmdStartWatching == cmd || MsgToRt::kCmdStartLogging == cmd || MsgToRt::kCmdStartTap == cmd)
+						putBuffer((FrameBuffer*)(uintptr_t)msgs[k].args[3]);
+				}
+				delete b;
+			}
+			n = end;
+		}
+		// the messages are in the pipe by now: this makes them visible
+		// to the RT thread, which reads the counter with acquire
+		if(numSent)
+			pipeSentNonRt.fetch_add(numSent, std::memory_order_release);
+	}
+
 	WatcherManager::Priv* WatcherManager::findPrivByName(const std::string& str) {
 		auto it = std::find_if(vec.begin(), vec.end(), [&str](decltype(vec[0])& item) {
 			return item->name == str;
@@ -262,7 +1969,7 @@ WatcherManager* Bela_getDefaultWatcherManager()
 		JSONObject root;
 		root[L"watcher"] = watcher;
 		JSONValue value(root);
-		gui.sendControl(&value, thread);
+		transport.sendControl(&value, thread);
 	}
 	bool WatcherManager::controlCallback(JSONObject& root)
 	{
@@ -280,29 +1987,70 @@ WatcherManager* Bela_getDefaultWatcherManager()
 					auto& v = *item;
 					JSONObject watcher;
 					watcher[L"name"] = new JSONValue(JSON::s2ws(v.name));
+					watcher[L"id"] = new JSONValue(int(v.id));
+					watcher[L"bufferId"] = new JSONValue(int(v.guiBufferId));
 					watcher[L"watched"] = new JSONValue(isStreaming(&v, kStreamIdxWatch));
 					watcher[L"controlled"] = new JSONValue(v.controlled);
 					watcher[L"logged"] = new JSONValue(isStreaming(&v, kStreamIdxLog));
+					watcher[L"replayed"] = new JSONValue(nullptr != v.replay);
+					watcher[L"stats"] = new JSONValue(v.tap && v.tap->stats);
+					watcher[L"spectrum"] = new JSONValue(v.tap && v.tap->spectrum);
+					watcher[L"spectrumBufferId"] = new JSONValue(int(v.spectrumBufferId));
+					watcher[L"tapDropped"] = new JSONValue(v.tap ? double(v.tap->dropped) : 0.0);
 					watcher[L"monitor"] = new JSONValue(int((~kMonitorChange) & v.monitoring));
 					watcher[L"logFileName"] = new JSONValue(JSON::s2ws(v.logFileName));
 					watcher[L"value"] = new JSONValue(v.w->wmGet());
 					watcher[L"valueInput"] = new JSONValue(v.w->wmGetInput());
 					watcher[L"type"] = new JSONValue(JSON::s2ws(v.type));
 					watcher[L"timestampMode"] = new JSONValue(v.timestampMode);
+					watcher[L"watchFrameSize"] = new JSONValue(int(v.streams[kStreamIdxWatch].frameSize));
+					watcher[L"logFrameSize"] = new JSONValue(int(v.streams[kStreamIdxLog].frameSize));
+					watcher[L"maxFrameSize"] = new JSONValue(int(v.maxFrameSize));
+					watcher[L"derived"] = new JSONValue(JSON::s2ws(v.derived ? v.derived->expression : ""));
 					watchers.emplace_back(new JSONValue(watcher));
 				}
 				JSONObject watcher;
 				watcher[L"watchers"] = new JSONValue(watchers);
 				watcher[L"sampleRate"] = new JSONValue(float(sampleRate));
 				watcher[L"timestamp"] = new JSONValue(double(timestamp));
+				watcher[L"monitorBufferId"] = new JSONValue(int(monitorBufferId));
+				{
+					std::lock_guard<std::mutex> lock(buffersMutex);
+					size_t pooled = 0;
+					for(auto buffer : bufferPool)
+						pooled += buffer->size();
+					watcher[L"bufferBytesInUse"] = new JSONValue(double(bufferBytesInUse));
+					watcher[L"bufferBytesPooled"] = new JSONValue(double(pooled));
+				}
 				sendJsonResponse(new JSONValue(watcher), WSServer::kThreadCallback);
 			} else
-			if("watch" == cmd || "unwatch" == cmd || "control" == cmd || "uncontrol" == cmd || "log" == cmd || "unlog" == cmd || "monitor" == cmd) {
+			if("watch" == cmd || "unwatch" == cmd || "control" == cmd || "uncontrol" == cmd || "log" == cmd || "unlog" == cmd || "monitor" == cmd || "replay" == cmd || "unreplay" == cmd || "stats" == cmd || "unstats" == cmd || "resetStats" == cmd || "spectrum" == cmd || "unspectrum" == cmd) {
 				const JSONArray& watchers = JSONGetArray(el, "watchers");
 				const JSONArray& periods = JSONGetArray(el, "periods"); // used only by 'monitor'
 				const JSONArray& timestamps = JSONGetArray(el, "timestamps"); // used only by some commands
 				const JSONArray& durations = JSONGetArray(el, "durations"); // used only by some commands
-				size_t numSent = 0;
+				const JSONArray& fileNames = JSONGetArray(el, "fileNames"); // used only by 'replay'
+				const JSONArray& frameSizes = JSONGetArray(el, "frameSizes"); // used only by 'watch', 'log', 'stats' and 'spectrum'
+				// used only by 'stats' and 'resetStats'
+				const JSONArray& bins = JSONGetArray(el, "bins");
+				const JSONArray& ranges = JSONGetArray(el, "ranges");
+				const JSONArray& scales = JSONGetArray(el, "scales");
+				const JSONArray& percentilesArr = JSONGetArray(el, "percentiles");
+				// used only by 'spectrum'
+				const JSONArray& sizes = JSONGetArray(el, "sizes");
+				const JSONArray& hops = JSONGetArray(el, "hops");
+				const JSONArray& averages = JSONGetArray(el, "averages");
+				const JSONArray& windows = JSONGetArray(el, "windows");
+				const JSONArray& peaks = JSONGetArray(el, "peaks");
+				const JSONArray& logs = JSONGetArray(el, "logs");
+				std::vector<double> percentiles = { 50, 90, 99 };
+				if(percentilesArr.size())
+				{
+					percentiles.resize(percentilesArr.size());
+					for(size_t n = 0; n < percentilesArr.size(); ++n)
+						percentiles[n] = JSONGetAsNumber(percentilesArr[n]);
+				}
+				std::vector<MsgToRt> msgs;
 				for(size_t n = 0; n < watchers.size(); ++n)
 				{
 					std::string str = JSONGetAsString(watchers[n]);
@@ -314,6 +2062,7 @@ WatcherManager* Bela_getDefaultWatcherManager()
 					{
 						AbsTimestamp timestamp = 0;
 						AbsTimestamp duration = 0;
+						size_t frameSize = p->maxFrameSize;
 						MsgToRt msg {
 							.priv = p,
 							.cmd = MsgToRt::kCmdNone,
@@ -322,28 +2071,185 @@ WatcherManager* Bela_getDefaultWatcherManager()
 							timestamp = JSONGetAsNumber(timestamps[n]);
 						if(n < durations.size())
 							duration = JSONGetAsNumber(durations[n]);
+						if(n < frameSizes.size())
+						{
+							frameSize = sanitiseFrameSize(JSONGetAsNumber(frameSizes[n]), p->typeSize);
+							if(frameSize > p->maxFrameSize)
+							{
+								fprintf(stderr, "%s: frame size %zu for %s is larger than the maximum %zu\n", cmd.c_str(), frameSize, p->name.c_str(), p->maxFrameSize);
+								frameSize = p->maxFrameSize;
+							}
+						}
+						if(p->derived)
+						{
+							// never reaches the RT thread
+							if("monitor" == cmd && n < periods.size())
+							{
+								std::lock_guard<std::mutex> lock(tapsMutex);
+								setMonitoring(p, JSONGetAsNumber(periods[n]));
+							} else if(!derivedCommand(p, cmd, timestamp, duration, frameSize))
+								fprintf(stderr, "%s: not supported on derived watcher %s\n", cmd.c_str(), p->name.c_str());
+							continue;
+						}
 						if("watch" == cmd) {
+							// registered on first use and kept: the
+							// Gui can't unregister buffers and clients
+							// would misattribute frames if ids moved
+							// between watchers
+							if(kNoGuiBufferId == p->guiBufferId)
+								p->guiBufferId = transport.registerBuffer(p->type[0], p->maxFrameSize);
 							msg.cmd = MsgToRt::kCmdStartWatching;
 							msg.args[0] = timestamp;
 							msg.args[1] = duration;
+							msg.args[2] = frameSize;
 						} else if("unwatch" == cmd) {
 							msg.cmd = MsgToRt::kCmdStopWatching;
 							msg.args[0] = timestamp;
 						}
-						else if("control" == cmd)
-							startControlling(p);
-						else if("uncontrol" == cmd)
-							stopControlling(p);
+						else if("control" == cmd || "uncontrol" == cmd) {
+							if("control" == cmd)
+								startControlling(p);
+							else
+								stopControlling(p);
+							// a replay in progress no longer decides
+							// what happens when it ends
+							std::lock_guard<std::mutex> lock(replaysMutex);
+							for(auto r : replays)
+							{
+								if(r->priv == p)
+									r->tookControl = false;
+							}
+						}
 						else if("log" == cmd) {
 							if(isStreaming(p, kStreamIdxLog))
 								continue;
 							msg.cmd = MsgToRt::kCmdStartLogging;
 							msg.args[0] = timestamp;
 							msg.args[1] = duration;
-							setupLogger(p);
+							msg.args[2] = frameSize;
+							setupLogger(p, frameSize);
 						} else if("unlog" == cmd) {
 							msg.cmd = MsgToRt::kCmdStopLogging;
 							msg.args[0] = timestamp;
+						} else if("replay" == cmd) {
+							std::string fileName = p->logFileName.size() ? p->logFileName : p->name + ".bin";
+							if(n < fileNames.size())
+								fileName = JSONGetAsString(fileNames[n]);
+							std::lock_guard<std::mutex> lock(replaysMutex);
+							if(replays.end() != std::find_if(replays.begin(), replays.end(), [p](Replay* r) { return r->priv == p; }))
+								continue; // already replaying
+							Replay* r = setupReplay(p, fileName);
+							if(!r)
+								continue;
+							// leave it alone when stopping if it was
+							// already controlled
+							r->tookControl = !p->controlled;
+							startControlling(p);
+							replays.push_back(r);
+							msg.cmd = MsgToRt::kCmdStartReplaying;
+							msg.args[0] = timestamp;
+							msg.args[1] = (uintptr_t)r;
+						} else if("unreplay" == cmd) {
+							msg.cmd = MsgToRt::kCmdStopReplaying;
+						} else if("stats" == cmd || "resetStats" == cmd) {
+							std::lock_guard<std::mutex> lock(tapsMutex);
+							if("resetStats" == cmd && !(p->tap && p->tap->stats))
+								continue;
+							double numBins = kStatsDefaultBins;
+							if(n < bins.size())
+								numBins = JSONGetAsNumber(bins[n]);
+							bool logScale = n < scales.size() && "log" == JSONGetAsString(scales[n]);
+							bool autoRange = n >= ranges.size();
+							double lo = autoRange ? 0 : JSONGetNumber(ranges[n], 0);
+							double hi = autoRange ? 0 : JSONGetNumber(ranges[n], 1);
+							if(!(numBins >= 1 && numBins <= kStatsMaxBins))
+							{
+								fprintf(stderr, "%s: %s: bins should be between 1 and %u\n", cmd.c_str(), p->name.c_str(), kStatsMaxBins);
+								continue;
+							}
+							if(!autoRange && !(lo < hi && (!logScale || lo > 0)))
+							{
+								fprintf(stderr, "%s: %s: invalid range [%f, %f]%s\n", cmd.c_str(), p->name.c_str(), lo, hi, logScale ? " for a log scale" : "");
+								continue;
+							}
+							Tap* tap = setupTap(p);
+							bool wasTapping = tapHasConsumers(tap);
+							if(!tap->stats || "resetStats" == cmd)
+							{
+								if(!tap->stats)
+									tap->stats = new Stats;
+								tap->stats->setup(numBins, lo, hi, logScale, autoRange);
+							}
+							if(!wasTapping)
+							{
+								msg.cmd = MsgToRt::kCmdStartTap;
+								msg.args[0] = timestamp;
+								msg.args[1] = duration;
+								msg.args[2] = frameSize;
+							}
+							if("stats" == cmd)
+								sendStats(p, percentiles);
+						} else if("unstats" == cmd) {
+							std::lock_guard<std::mutex> lock(tapsMutex);
+							if(!p->tap || !p->tap->stats)
+								continue;
+							delete p->tap->stats;
+							p->tap->stats = nullptr;
+							if(!tapHasConsumers(p->tap))
+							{
+								msg.cmd = MsgToRt::kCmdStopTap;
+								msg.args[0] = timestamp;
+							}
+							// as for unspectrum: without the stats
+							sendStats(p, percentiles);
+						} else if("spectrum" == cmd) {
+							std::lock_guard<std::mutex> lock(tapsMutex);
+							Tap* tap = setupTap(p);
+							bool wasTapping = tapHasConsumers(tap);
+							size_t size = Spectrum::sanitiseSize(n < sizes.size() ? JSONGetAsNumber(sizes[n]) : kSpectrumDefaultSize);
+							size_t hop = n < hops.size() ? JSONGetAsNumber(hops[n]) : size / 2;
+							size_t numAverages = n < averages.size() ? JSONGetAsNumber(averages[n]) : 1;
+							bool peak = n < peaks.size() && JSONGetAsNumber(peaks[n]);
+							Spectrum::Window window = Spectrum::findWindow(n < windows.size() ? JSONGetAsString(windows[n]) : "hann");
+							// reconfiguring starts afresh
+							delete tap->spectrum;
+							tap->spectrum = new Spectrum;
+							tap->spectrum->setup(size, hop, numAverages, peak, window);
+							tap->spectrum->tapDropped = tap->dropped.load(std::memory_order_relaxed);
+							size_t spectrumFrameSize = tap->spectrum->frame.size();
+							// registered on first use and kept, as for
+							// guiBufferId, so it has to fit any size
+							if(kNoGuiBufferId == p->spectrumBufferId)
+								p->spectrumBufferId = transport.registerBuffer('f', Spectrum::frameSize(kSpectrumMaxSize));
+							if(n < logs.size() && JSONGetAsNumber(logs[n]))
+							{
+								Spectrum& s = *tap->spectrum;
+								s.logger = new WriteFile((p->name + ".spectrum.bin").c_str(), false, false);
+								s.logger->setFileType(kBinary);
+								s.logFileName = s.logger->getName();
+								std::vector<uint8_t> header = logHeader(p->name, kSpectrumLogType, spectrumFrameSize);
+								s.logger->log((float*)(header.data()), header.size() / sizeof(float));
+							}
+							if(!wasTapping)
+							{
+								msg.cmd = MsgToRt::kCmdStartTap;
+								msg.args[0] = timestamp;
+								msg.args[1] = duration;
+								msg.args[2] = frameSize;
+							}
+							sendSpectrumResponse(p);
+						} else if("unspectrum" == cmd) {
+							std::lock_guard<std::mutex> lock(tapsMutex);
+							if(!p->tap || !p->tap->spectrum)
+								continue;
+							delete p->tap->spectrum;
+							p->tap->spectrum = nullptr;
+							if(!tapHasConsumers(p->tap))
+							{
+								msg.cmd = MsgToRt::kCmdStopTap;
+								msg.args[0] = timestamp;
+							}
+							sendSpectrumResponse(p);
 						} else if ("monitor" == cmd) {
 							if(n < periods.size())
 							{
@@ -354,24 +2260,51 @@ WatcherManager* Bela_getDefaultWatcherManager()
 								break;
 							}
 						}
+						if(MsgToRt::kCmdStartWatching == msg.cmd || MsgToRt::kCmdStartLogging == msg.cmd || MsgToRt::kCmdStartTap == msg.cmd)
+							msg.args[3] = (uintptr_t)getBuffer(frameSize);
 						if(MsgToRt::kCmdNone != msg.cmd)
-						{
-							pipe.writeNonRt(msg);
-							numSent++;
-						}
+							msgs.push_back(msg);
 					}
 				}
 #ifdef WATCHER_PRINT
 				printf("\n");
 #endif // WATCHER_PRINT
-				if(numSent)
+				sendCommands(msgs);
+			} else
+			if("derive" == cmd || "underive" == cmd) {
+				// e.g.: {"cmd":"derive","watchers":["diff"],"expressions":["a - b"]}
+				const JSONArray& watchers = JSONGetArray(el, "watchers");
+				const JSONArray& expressions = JSONGetArray(el, "expressions"); // used only by 'derive'
+				for(size_t n = 0; n < watchers.size(); ++n)
 				{
-					// this full memory barrier may be
-					// unnecessary as the system calls in Pipe::writeRt()
-					// may be enough
-					// or it may be useless and still leave the problem unaddressed
-					std::atomic_thread_fence(std::memory_order_release);
-					pipeSentNonRt += numSent;
+					std::string name = JSONGetAsString(watchers[n]);
+					JSONObject watcher;
+					watcher[L"watcher"] = new JSONValue(JSON::s2ws(name));
+					if("derive" == cmd)
+					{
+						if(n >= expressions.size())
+						{
+							fprintf(stderr, "derive cmd with not enough elements in expressions: %zu instead of %zu\n", expressions.size(), watchers.size());
+							break;
+						}
+						std::string expression = JSONGetAsString(expressions[n]);
+						std::string error;
+						Priv* p = setupDerived(name, expression, error);
+						watcher[L"derived"] = new JSONValue(JSON::s2ws(expression));
+						if(p)
+							watcher[L"id"] = new JSONValue(int(p->id));
+						else {
+							fprintf(stderr, "derive: %s: %s\n", name.c_str(), error.c_str());
+							watcher[L"error"] = new JSONValue(JSON::s2ws(error));
+						}
+					} else {
+						Priv* p = findPrivByName(name);
+						if(!p || !p->derived)
+							continue;
+						cleanupDerived(p->derived);
+						watcher[L"derived"] = new JSONValue(JSON::s2ws(""));
+					}
+					sendJsonResponse(new JSONValue(watcher), WSServer::kThreadCallback);
 				}
 			} else
 			if("set" == cmd || "setMask" == cmd) {
@@ -404,8 +2337,9 @@ WatcherManager* Bela_getDefaultWatcherManager()
 		}
 		return false;
 	}
-	WatcherManager::Details* WatcherManager::doReg(WatcherBase* that, std::string name, TimestampMode timestampMode, const std::string& typeName, size_t typeSize)
+	WatcherManager::Details* WatcherManager::doReg(WatcherBase* that, std::string name, TimestampMode timestampMode, const std::string& typeName, size_t typeSize, size_t frameSize)
 	{
+		frameSize = sanitiseFrameSize(frameSize, typeSize);
 		if("" == name)
 			name = "(anon)";
 		// sanitise
@@ -435,23 +2369,24 @@ WatcherManager* Bela_getDefaultWatcherManager()
 		}
 		vec.emplace_back(new Priv{
 			.w = that,
-			.count = 0,
+			.id = nextId++,
 			.name = name,
-			.guiBufferId = gui.setBuffer(typeName[0], kBufSize),
+			.guiBufferId = kNoGuiBufferId,
+			.spectrumBufferId = kNoGuiBufferId,
 			.logger = nullptr,
 			.type = typeName,
+			.typeSize = typeSize,
 			.timestampMode = timestampMode,
-			.firstTimestamp = 0,
-			.relTimestampsOffset = getRelTimestampsOffset(typeSize),
-			.countRelTimestamps = 0,
+			.maxFrameSize = frameSize,
 			.monitoring = kMonitorDont,
+			.replay = nullptr,
+			.tap = nullptr,
+			.derived = nullptr,
 			.controlled = false,
 		});
+		// frame buffers are only allocated once the watcher
+		// is streamed somewhere
 		Priv* p = vec.back();
-		p->v.resize(kBufSize); // how do we include this above?
-		if(((uintptr_t)p->v.data() + kMsgHeaderLength) & (typeSize - 1))
-			throw(std::bad_alloc());
-		p->maxCount = kTimestampBlock == p->timestampMode ? p->v.size() : p->relTimestampsOffset - (typeSize - 1);
 		updateSometingToDo(p);
 		return (Details*)vec.back();
 	}
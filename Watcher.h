@@ -8,6 +8,7 @@
 #include <atomic>
 #include <RtMsgFifo.h>
 #include <string.h>
+#include <assert.h>
 
 class WatcherManager;
 class WatcherBase {
@@ -35,8 +36,10 @@ protected:
 #include <vector>
 #include <libraries/Gui/Gui.h>
 #include <libraries/WriteFile/WriteFile.h>
+#include "WatcherTransport.h"
 
 #include <thread>
+#include <mutex>
 class WatcherManager
 {
 	static constexpr uint32_t kMonitorDont = 0;
@@ -44,66 +47,181 @@ class WatcherManager
 	typedef uint64_t AbsTimestamp;
 	typedef uint32_t RelTimestamp;
 	struct Priv;
+	struct MsgToRt;
 	std::thread pipeToJsonThread;
+	std::thread replayThread;
+	std::thread tapThread;
 	AbsTimestamp timestamp = 0;
-	size_t pipeReceivedRt = 0;
-	size_t pipeSentNonRt = 0;
+	size_t pipeReceivedRt = 0; // only accessed by the RT thread
+	// incremented by the non-RT thread once the messages are in the pipe
+	std::atomic<size_t> pipeSentNonRt;
 	RtNonRtMsgFifo pipe;
 	volatile bool shouldStop;
 	static constexpr size_t kMsgHeaderLength = sizeof(timestamp);
 	static_assert(0 == kMsgHeaderLength % sizeof(float), "has to be multiple");
 	static constexpr size_t kBufSize = 4096 + kMsgHeaderLength;
-	static size_t getRelTimestampsOffset(size_t dataSize);
+	static constexpr size_t getRelTimestampsOffset(size_t dataSize, size_t frameSize);
+	static constexpr size_t sanitiseFrameSize(size_t frameSize, size_t typeSize);
+	static constexpr size_t kReplayRingSize = 4 * kBufSize;
+	static constexpr unsigned int kReplayPollUs = 10000;
+	static constexpr size_t kTapQueueLength = 8;
+	static constexpr unsigned int kTapPollUs = 10000;
+	static constexpr size_t kStatsDefaultBins = 64;
+	static constexpr unsigned int kStatsMaxBins = 65536;
+	static constexpr size_t kSpectrumDefaultSize = 1024;
+	static constexpr size_t kSpectrumMaxSize = 65536;
+	// at most this many MsgToRt (counting each one in a Batch) are
+	// handled per tick(), the others are left for the following ones
+	static constexpr size_t kRtCommandsPerTick = 16;
+	// values a derived watcher buffers for a source while waiting for
+	// the others to catch up
+	static constexpr size_t kDerivedMaxPending = 65536;
+	// appended to a log when it stops, followed by the number of values
+	// in its last frame, so that replay can tell them from the padding
+	static constexpr uint32_t kLogTrailerMagic = 0x646e6557; // "Wend"
+	// after the fields of the version 1 header of a log, followed by
+	// the version and by the fields added since then
+	static constexpr uint32_t kLogHeaderMagic = 0x76687457; // "Wthv"
+	static constexpr uint32_t kLogVersion = 2;
+	// in place of the type in the header of spectrum logs
+	static constexpr const char* kSpectrumLogType = "spectrum";
+	static constexpr unsigned int kNoGuiBufferId = -1;
 public:
 	WatcherManager(Gui& gui);
+	WatcherManager(WatcherTransport& transport);
 	~WatcherManager();
-	void setup(float sampleRate);
+	// blockSize is the number of frames between calls to tick(..., true).
+	// It is used to delay the start of large batches of commands so that
+	// they all start together. If it is 0 it is measured by tick().
+	void setup(float sampleRate, size_t blockSize = 0);
 	class Details;
 	enum TimestampMode {
 		kTimestampBlock,
 		kTimestampSample,
 	};
+	// size in bytes of a frame, including its header. Smaller frames
+	// reach the GUI with lower latency, larger ones are cheaper to log.
+	static constexpr size_t kDefaultFrameSize = kBufSize;
+	// frameSize is the default size of the frames of the watcher and
+	// the largest one that can be requested with a watch or log command
 	template <typename T>
-	Details* reg(WatcherBase* that, const std::string& name, TimestampMode timestampMode)
+	Details* reg(WatcherBase* that, const std::string& name, TimestampMode timestampMode, size_t frameSize = kDefaultFrameSize)
 	{
-		return doReg(that, name, timestampMode, typeid(T).name(), sizeof(T));
+		return doReg(that, name, timestampMode, typeid(T).name(), sizeof(T), frameSize);
 	}
 	void unreg(WatcherBase* that);
 	void tick(AbsTimestamp frames, bool full = true)
 	{
+		// values gathered during the previous tick all share its timestamp
+		sendMonitorFrame();
 		timestamp = frames;
 		if(!full)
 			return;
-		while(pipeReceivedRt != pipeSentNonRt)
+		if(blockSize)
+			tickLength = blockSize;
+		else if(hadFullTick && frames > lastFullTick)
+			tickLength = frames - lastFullTick;
+		hadFullTick = true;
+		lastFullTick = frames;
+		processCommands();
+		clientActive = transport.numActiveConnections();
+		transport.sendDeferred();
+	}
+private:
+	void processCommands()
+	{
+		size_t budget = kRtCommandsPerTick;
+		while(budget)
 		{
-			MsgToRt msg;
-			if(1 == pipe.readRt(msg))
+			if(batch)
 			{
-				pipeReceivedRt++;
-				switch(msg.cmd)
+				Batch& b = *batch;
+				if(!b.next)
 				{
-					case MsgToRt::kCmdStartLogging:
-						startLogging(msg.priv, msg.args[0], msg.args[1]);
-						break;
-					case MsgToRt::kCmdStopLogging:
-						stopLogging(msg.priv, msg.args[0]);
-						break;
-					case MsgToRt::kCmdStartWatching:
-						startWatching(msg.priv, msg.args[0], msg.args[1]);
-						break;
-					case MsgToRt::kCmdStopWatching:
-						stopWatching(msg.priv, msg.args[0]);
-						break;
-					case MsgToRt::kCmdNone:
+					// the messages in a batch start at the same
+					// timestamp: make sure they still do so even if
+					// it takes several ticks to go through them
+					size_t ticks = b.msgs.size() > budget ? (b.msgs.size() - budget + kRtCommandsPerTick - 1) / kRtCommandsPerTick : 0;
+					// until the first two full ticks we don't know
+					// how long that is
+					if(ticks && !tickLength)
 						break;
+					AbsTimestamp earliest = timestamp + ticks * tickLength;
+					for(auto& m : b.msgs)
+					{
+						if(m.isTimedStart() && m.args[0] < earliest)
+							m.args[0] = earliest;
+					}
 				}
-			} else {
-				rt_fprintf(stderr, "Error: missing messages in the pipe\n");
-				pipeReceivedRt = pipeSentNonRt;
+				for(; budget && b.next < b.msgs.size(); --budget)
+					runCommand(b.msgs[b.next++]);
+				if(b.next < b.msgs.size())
+					break;
+				// give it back to be deleted
+				MsgToNrt msg {
+					.priv = nullptr,
+					.cmd = MsgToNrt::kCmdBatchDone,
+					.args = {
+						(uintptr_t)batch,
+					},
+				};
+				pipe.writeRt(msg);
+				batch = nullptr;
+				continue;
 			}
+			if(pipeReceivedRt == pipeSentNonRt.load(std::memory_order_acquire))
+				break;
+			MsgToRt msg;
+			// the message was written before the counter was
+			// incremented, so this should never fail, but if it
+			// does we try again at the next tick
+			if(1 != pipe.readRt(msg))
+				break;
+			pipeReceivedRt++;
+			budget--;
+			if(MsgToRt::kCmdBatch != msg.cmd)
+			{
+				runCommand(msg);
+				continue;
+			}
+			batch = (Batch*)(uintptr_t)msg.args[0];
+			batch->next = 0;
+		}
+	}
+	void runCommand(const MsgToRt& msg)
+	{
+		switch(msg.cmd)
+		{
+			case MsgToRt::kCmdStartLogging:
+				startLogging(msg.priv, msg.args[0], msg.args[1], msg.args[2], (FrameBuffer*)(uintptr_t)msg.args[3]);
+				break;
+			case MsgToRt::kCmdStopLogging:
+				stopLogging(msg.priv, msg.args[0]);
+				break;
+			case MsgToRt::kCmdStartWatching:
+				startWatching(msg.priv, msg.args[0], msg.args[1], msg.args[2], (FrameBuffer*)(uintptr_t)msg.args[3]);
+				break;
+			case MsgToRt::kCmdStopWatching:
+				stopWatching(msg.priv, msg.args[0]);
+				break;
+			case MsgToRt::kCmdStartReplaying:
+				startReplaying(msg.priv, (Replay*)(uintptr_t)msg.args[1], msg.args[0]);
+				break;
+			case MsgToRt::kCmdStopReplaying:
+				stopReplaying(msg.priv);
+				break;
+			case MsgToRt::kCmdStartTap:
+				startStreamAtFor(msg.priv, kStreamIdxTap, msg.args[0], msg.args[1], msg.args[2], (FrameBuffer*)(uintptr_t)msg.args[3]);
+				break;
+			case MsgToRt::kCmdStopTap:
+				stopStreamAt(msg.priv, kStreamIdxTap, msg.args[0]);
+				break;
+			case MsgToRt::kCmdBatch: // batches don't nest
+			case MsgToRt::kCmdNone:
+				break;
 		}
-		clientActive = gui.numActiveConnections();
 	}
+public:
 	void updateSometingToDo(Priv* p, bool should = false)
 	{
 		for(auto& stream : p->streams)
@@ -112,6 +230,7 @@ public:
 			should |= stream.state;
 		}
 		should |= (kMonitorDont != p->monitoring);
+		should |= (nullptr != p->replay);
 		// TODO: is watching should be conditional to && clientActive,
 		// but for that to work, we'd need to call this for each client
 		// on clientActive change, which could be very expensive
@@ -128,7 +247,8 @@ public:
 			return;
 		if(!p->somethingToDo)
 			return;
-		bool streamLast = false;
+		if(p->replay)
+			replayNext(p);
 		for(auto& stream : p->streams)
 		{
 			if(timestamp >= stream.schedTsStart)
@@ -137,10 +257,9 @@ public:
 				if(kStreamStateStarting == stream.state)
 				{
 					stream.state = kStreamStateYes;
-					// TODO: watching and logging use the same buffer,
-					// so you'll get a dropout in the watching if you
-					// are watching right now
-					p->count = 0;
+					// each stream has its own buffer, so this
+					// doesn't affect the others
+					stream.count = 0;
 					if(-1 != stream.schedTsEnd) {
 						// if an end timestamp is provided,
 						// schedule the end immediately
@@ -151,7 +270,6 @@ public:
 				else if(kStreamStateStopping == stream.state)
 				{
 					stream.state = kStreamStateLast;
-					streamLast = true;
 				}
 				updateSometingToDo(p);
 			}
@@ -170,16 +288,7 @@ public:
 			if(timestamp >= p->monitoringNext)
 			{
 				if(clientActive)
-				{
-					// big enough for the timestamp and one value
-					// and possibly some padding bytes at the end
-					// (though in practice there won't be any when
-					// sizeof(T) <= kMsgHeaderLength)
-					uint8_t data[((kMsgHeaderLength + sizeof(value) + sizeof(T) - 1) / sizeof(T)) * sizeof(T)];
-					memcpy(data, &timestamp, kMsgHeaderLength);
-					memcpy(data + kMsgHeaderLength, &value, sizeof(value));
-					gui.sendBuffer(p->guiBufferId, (T*)data, sizeof(data) / sizeof(T));
-				}
+					monitorAppend(p->id, &value, sizeof(value));
 				if(1 == p->monitoring)
 				{
 					// special case: one-shot
@@ -190,80 +299,45 @@ public:
 					p->monitoringNext = timestamp + p->monitoring;
 			}
 		}
-		if((isStreaming(p, kStreamIdxWatch) && clientActive) || isStreaming(p, kStreamIdxLog))
+		// a follower released by its leader ending a frame below
+		// already had this value written for it
+		std::array<bool,kStreamIdxNum> wasFollowing;
+		for(size_t n = 0; n < p->streams.size(); ++n)
+			wasFollowing[n] = p->streams[n].following;
+		for(size_t n = 0; n < p->streams.size(); ++n)
 		{
-			if(0 == p->count)
-			{
-				memcpy(p->v.data(), &timestamp, kMsgHeaderLength);
-				p->firstTimestamp = timestamp;
-				p->count += kMsgHeaderLength;
-				p->countRelTimestamps = p->relTimestampsOffset;
-			}
-			*(T*)(p->v.data() + p->count) = value;
-			p->count += sizeof(value);
-			bool full = p->count >= p->maxCount;
-			if(kTimestampSample == p->timestampMode)
+			Stream& stream = p->streams[n];
+			if(!isStreaming(p, StreamIdx(n)) || stream.following || wasFollowing[n])
+				continue;
+			if(kStreamIdxWatch == n && !clientActive)
 			{
-				// we have two arrays: one of type T starting
-				// at kMsgHeaderLength and one of type
-				// RelTimestamp starting at relTimestampsOffset
-				RelTimestamp relTimestamp = timestamp - p->firstTimestamp;
-				*(RelTimestamp*)(p->v.data() + p->countRelTimestamps) = relTimestamp;
-				p->countRelTimestamps += sizeof(relTimestamp);
-				full |= (p->count >= p->relTimestampsOffset || p->countRelTimestamps >= p->v.size());
-			} else {
-				// only one array of type T starting at
-				// kMsgHeaderLength
-			}
-			if(full || streamLast)
-			{
-				if(!full)
+				// nobody to send it to: drop the current frame
+				splitFrame(p, StreamIdx(n));
+				stream.count = 0;
+				if(kStreamStateLast == stream.state)
 				{
-					// when logging stops, we need to fill
-					// up all the remaining space with zeros
-					// TODO: remove this when we support
-					// variable-length blocks
-					if(kTimestampSample == p->timestampMode)
-					{
-						memset(p->v.data() + p->count, 0, p->relTimestampsOffset - p->count);
-						memset(p->v.data() + p->countRelTimestamps, 0, p->v.size() - p->countRelTimestamps);
-					} else
-						memset(p->v.data() + p->count, 0, p->v.size() - p->count);
-				}
-				// TODO: in order to even out the CPU load,
-				// incoming data should be copied out of the
-				// audio thread one value at a time
-				// avoiding big copies like this one
-				// OTOH, we'll need to ensure only full blocks
-				// are sent so that we don't lose track of the
-				// header
-
-				send<T>(p);
-				bool shouldUpdate = false;
-				for(size_t n = 0; n < p->streams.size(); ++n)
-				{
-					Stream& stream = p->streams[n];
-					if(kStreamStateLast == stream.state)
-					{
-						if(kStreamIdxLog == n)
-							p->logger->requestFlush();
-						stream.state = kStreamStateNo;
-						shouldUpdate = true;
-					}
-				}
-				if(shouldUpdate)
+					stream.state = kStreamStateNo;
+					releaseBuffer(p, StreamIdx(n));
 					updateSometingToDo(p);
-				p->count = 0;
+				}
+				continue;
 			}
+			streamValue(p, StreamIdx(n), value);
 		}
 	}
+	// only valid if constructed with a Gui
 	Gui& getGui() {
-		return gui;
+		assert(gui);
+		return *gui;
+	}
+	WatcherTransport& getTransport() {
+		return transport;
 	}
 private:
 	enum StreamIdx {
 		kStreamIdxLog,
 		kStreamIdxWatch,
+		kStreamIdxTap, // frames go to tapThread
 		kStreamIdxNum,
 	};
 	enum StreamState {
@@ -273,36 +347,109 @@ private:
 		kStreamStateStopping,
 		kStreamStateLast,
 	};
+	typedef std::vector<unsigned char> FrameBuffer;
 	struct Stream {
 		AbsTimestamp schedTsStart = -1;
 		AbsTimestamp schedTsEnd = -1;
 		StreamState state = kStreamStateNo;
+		// handed over with the start command and given back to the
+		// pool with releaseBuffer() once the stream is done with it
+		FrameBuffer* buffer = nullptr;
+		unsigned char* v = nullptr; // buffer->data()
+		size_t count = 0;
+		AbsTimestamp firstTimestamp = 0;
+		size_t frameSize = 0;
+		size_t relTimestampsOffset = 0;
+		size_t countRelTimestamps = 0;
+		size_t maxCount = 0;
+		// while streams are aligned, the values are only written to
+		// the frame of the first one and the frame is sent to all
+		uint32_t followers = 0; // bitmask of StreamIdx
+		bool following = false;
 	};
+	struct Replay;
+	struct Tap;
+	struct Derived;
 	struct Priv {
 		WatcherBase* w;
-		std::vector<unsigned char> v;
-		size_t count;
+		uint32_t id;
 		std::string name;
-		unsigned int guiBufferId;
+		unsigned int guiBufferId; // kNoGuiBufferId until first watched
+		unsigned int spectrumBufferId; // kNoGuiBufferId until the first spectrum
 		WriteFile* logger;
 		std::string logFileName;
 		std::string type;
+		size_t typeSize;
 		TimestampMode timestampMode;
-		AbsTimestamp firstTimestamp;
-		size_t relTimestampsOffset;
-		size_t countRelTimestamps;
-		size_t maxCount;
+		size_t maxFrameSize; // set at reg() time, the largest frame any stream may use
 		uint32_t monitoring;
 		AbsTimestamp monitoringNext;
 		std::array<Stream,kStreamIdxNum> streams;
-		bool controlled;
+		Replay* replay;
+		Tap* tap;
+		Derived* derived; // set if computed by tapThread from other watchers
+		bool controlled; // only changed with controlMutex held
 		bool somethingToDo;
 	};
+	struct ReplayValue {
+		AbsTimestamp timestamp; // relative to the first one in the file
+		double value;
+	};
+	struct TapFrame {
+		std::vector<unsigned char> v;
+		size_t size;
+		size_t numValues;
+	};
+	struct Stats;
+	struct Spectrum;
+	struct Expression;
+	// Completed frames of kStreamIdxTap are queued here by the RT thread
+	// and processed by tapThread. The RT cost of this is that of any other
+	// stream: one write per value and one copy per frame (none if it is
+	// aligned with another stream).
+	// Created on the non-RT side when first needed and kept until unreg().
+	struct Tap {
+		Priv* priv;
+		std::vector<TapFrame> frames;
+		std::atomic<size_t> writeIdx; // only written by the RT thread
+		std::atomic<size_t> readIdx; // only written by tapThread
+		std::atomic<size_t> dropped; // frames lost because the queue was full
+		size_t processed;
+		// consumers, protected by tapsMutex
+		Stats* stats;
+		Spectrum* spectrum;
+		std::vector<Derived*> derived;
+	};
+	// Owned by the non-RT side (and protected by replaysMutex there).
+	// The RT thread only accesses it between kCmdStartReplaying and
+	// kCmdStoppedReplaying, and then only pops values from the ring.
+	struct Replay {
+		Priv* priv;
+		FILE* file;
+		std::string fileName;
+		std::vector<unsigned char> frame;
+		std::vector<ReplayValue> ring;
+		std::atomic<size_t> writeIdx; // only written by the non-RT thread
+		std::atomic<size_t> readIdx; // only written by the RT thread
+		std::atomic<bool> eof;
+		size_t relTimestampsOffset;
+		// from the trailer: 0 if the log doesn't have one
+		size_t lastNumValues;
+		long dataEnd; // where the frames end and the trailer starts
+		bool legacy; // written by version 1
+		AbsTimestamp firstTimestamp; // only accessed by the non-RT thread
+		AbsTimestamp startTimestamp; // only accessed by the RT thread
+		bool tookControl; // protected by controlMutex
+	};
 	struct MsgToNrt {
 		Priv* priv;
 		enum Cmd {
 			kCmdNone,
 			kCmdStartedLogging,
+			kCmdStartedReplaying,
+			kCmdStoppedReplaying,
+			kCmdReleasedBuffer,
+			kCmdBatchDone,
 		} cmd;
 		uint64_t args[2];
 	};
@@ -314,41 +461,367 @@ private:
 			kCmdStopLogging,
 			kCmdStartWatching,
 			kCmdStopWatching,
+			kCmdStartReplaying,
+			kCmdStopReplaying,
+			kCmdStartTap,
+			kCmdStopTap,
+			kCmdBatch, // args[0] is a Batch*
 		} cmd;
-		uint64_t args[2];
+		uint64_t args[4];
+		// whether args[0] is the timestamp at which the command
+		// takes effect
+		bool isTimedStart() const
+		{
+			return kCmdStartLogging == cmd || kCmdStartWatching == cmd || kCmdStartReplaying == cmd || kCmdStartTap == cmd;
+		}
 	};
+	// Commands for many watchers sent as one message. Allocated by the
+	// non-RT thread, handed back with kCmdBatchDone once the RT thread
+	// has gone through it.
+	struct Batch {
+		std::vector<MsgToRt> msgs;
+		size_t next; // only accessed by the RT thread
+	};
+	void sendCommands(std::vector<MsgToRt>& msgs);
 	void pipeToJson();
+	void replayDecode();
+	void replayFill(Replay* r);
+	template <typename T>
+	void replayDecodeFrame(Replay* r, size_t numValues);
+	Replay* setupReplay(Priv* p, const std::string& fileName);
+	void cleanupReplay(Replay* r);
+	void tapProcess();
+	void tapProcessFrame(Tap* tap, const TapFrame& frame);
+	Tap* setupTap(Priv* p);
+	bool tapHasConsumers(const Tap* tap) const;
+	void cleanupTap(Tap* tap);
+	FrameBuffer* getBuffer(size_t size);
+	void putBuffer(FrameBuffer* buffer);
+	void sendStats(Priv* p, const std::vector<double>& percentiles);
+	void sendSpectrumResponse(Priv* p);
+	Priv* setupDerived(const std::string& name, const std::string& expression, std::string& error);
+	void cleanupDerived(Derived* d, const Priv* unregistering = nullptr);
+	template <typename T>
+	void derivedPush(Derived* d, const Priv* source, const TapFrame& frame);
+	void derivedRun(Derived* d);
+	bool derivedCommand(Priv* p, const std::string& cmd, AbsTimestamp timestamp, AbsTimestamp duration, size_t frameSize);
+	void derivedWrite(Priv* p, StreamIdx idx, double value, AbsTimestamp timestamp);
+	void derivedEndFrame(Priv* p, StreamIdx idx, bool full);
+	void derivedStop(Priv* p, StreamIdx idx);
+	template <typename T>
+	void spectrumProcessFrame(Tap* tap, const TapFrame& frame);
+	void sendNonRt(unsigned int bufferId, char type, const void* data, size_t size);
+	void replayNext(Priv* p)
+	{
+		// called from notify(): a replay only advances while the watcher
+		// is being set. In kTimestampSample mode all values whose
+		// timestamp is due are consumed and the latest one applied. A
+		// kTimestampBlock log doesn't say how many values there were per
+		// tick, so one value is consumed per call: for the replay to keep
+		// the pace of the recording, the watcher has to be set as often
+		// as it was then (e.g.: once per sample).
+		Replay& r = *p->replay;
+		if(timestamp < r.startTimestamp)
+			return;
+		AbsTimestamp elapsed = timestamp - r.startTimestamp;
+		// eof has to be read before writeIdx so we don't miss the
+		// values written right before it was set
+		bool eof = r.eof.load(std::memory_order_acquire);
+		size_t writeIdx = r.writeIdx.load(std::memory_order_acquire);
+		size_t readIdx = r.readIdx.load(std::memory_order_relaxed);
+		bool found = false;
+		double value = 0;
+		while(readIdx != writeIdx)
+		{
+			const ReplayValue& rv = r.ring[readIdx];
+			if(kTimestampSample == p->timestampMode && rv.timestamp > elapsed)
+				break;
+			value = rv.value;
+			found = true;
+			readIdx = (readIdx + 1) % r.ring.size();
+			if(kTimestampBlock == p->timestampMode)
+				break;
+		}
+		r.readIdx.store(readIdx, std::memory_order_release);
+		if(found)
+			p->w->wmSet(value);
+		else if(eof && readIdx == writeIdx)
+			stopReplaying(p);
+	}
 	bool isStreaming(const Priv* p, StreamIdx idx) const
 	{
 		StreamState state = p->streams[idx].state;
 		return kStreamStateYes == state || kStreamStateStopping == state|| kStreamStateLast == state;
 	}
+	// All the monitoring values due in a tick are gathered into a single
+	// frame: an AbsTimestamp followed by packed (uint32_t id, value)
+	// entries, where the size of each value is implied by the type of
+	// the watcher with that id. The frame is sent as an array of uint32_t,
+	// with up to 3 bytes of zero padding at the end.
+	void monitorAppend(uint32_t id, const void* value, size_t size)
+	{
+		if(monitorCount + sizeof(id) + size > monitorFrame.size())
+			sendMonitorFrame();
+		if(!monitorCount)
+		{
+			memcpy(monitorFrame.data(), &timestamp, kMsgHeaderLength);
+			monitorCount = kMsgHeaderLength;
+		}
+		memcpy(monitorFrame.data() + monitorCount, &id, sizeof(id));
+		monitorCount += sizeof(id);
+		memcpy(monitorFrame.data() + monitorCount, value, size);
+		monitorCount += size;
+	}
+	void sendMonitorFrame()
+	{
+		if(!monitorCount)
+			return;
+		size_t count = (monitorCount + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+		memset(monitorFrame.data() + monitorCount, 0, count * sizeof(uint32_t) - monitorCount);
+		transport.sendBuffer(monitorBufferId, monitorFrame.data(), count * sizeof(uint32_t), 'j');
+		monitorCount = 0;
+	}
+	bool isActive(const Priv* p, StreamIdx idx) const
+	{
+		return isStreaming(p, idx) && (kStreamIdxWatch != idx || clientActive);
+	}
+	void startFrame(Priv* p, StreamIdx idx)
+	{
+		Stream& stream = p->streams[idx];
+		memcpy(stream.v, &timestamp, kMsgHeaderLength);
+		stream.firstTimestamp = timestamp;
+		stream.count = kMsgHeaderLength;
+		stream.countRelTimestamps = stream.relTimestampsOffset;
+		// if other streams start a frame of the same size
+		// right now, this frame can serve all of them, so
+		// each value is copied only once
+		for(size_t n = 0; n < p->streams.size(); ++n)
+		{
+			Stream& other = p->streams[n];
+			if(n == idx || !isActive(p, StreamIdx(n)))
+				continue;
+			if(0 == other.count && !other.following && !other.followers && other.frameSize == stream.frameSize)
+			{
+				stream.followers |= 1 << n;
+				other.following = true;
+			}
+		}
+	}
+	// give follower its own copy of the current frame of idx, so that
+	// the two can go separate ways
+	void splitFrame(Priv* p, StreamIdx idx, StreamIdx followerIdx)
+	{
+		Stream& stream = p->streams[idx];
+		if(!(stream.followers & (1 << followerIdx)))
+			return;
+		Stream& follower = p->streams[followerIdx];
+		memcpy(follower.v, stream.v, stream.count);
+		if(kTimestampSample == p->timestampMode)
+			memcpy(follower.v + stream.relTimestampsOffset, stream.v + stream.relTimestampsOffset, stream.countRelTimestamps - stream.relTimestampsOffset);
+		follower.count = stream.count;
+		follower.countRelTimestamps = stream.countRelTimestamps;
+		follower.firstTimestamp = stream.firstTimestamp;
+		follower.following = false;
+		stream.followers &= ~(1 << followerIdx);
+	}
+	void splitFrame(Priv* p, StreamIdx idx)
+	{
+		for(size_t n = 0; n < p->streams.size(); ++n)
+			splitFrame(p, idx, StreamIdx(n));
+	}
+	template <typename T>
+	void streamValue(Priv* p, StreamIdx idx, const T& value)
+	{
+		Stream& stream = p->streams[idx];
+		if(0 == stream.count)
+			startFrame(p, idx);
+		*(T*)(stream.v + stream.count) = value;
+		stream.count += sizeof(value);
+		bool full = stream.count >= stream.maxCount;
+		if(kTimestampSample == p->timestampMode)
+		{
+			// we have two arrays: one of type T starting
+			// at kMsgHeaderLength and one of type
+			// RelTimestamp starting at relTimestampsOffset
+			RelTimestamp relTimestamp = timestamp - stream.firstTimestamp;
+			*(RelTimestamp*)(stream.v + stream.countRelTimestamps) = relTimestamp;
+			stream.countRelTimestamps += sizeof(relTimestamp);
+			full |= (stream.count >= stream.relTimestampsOffset || stream.countRelTimestamps >= stream.frameSize);
+		} else {
+			// only one array of type T starting at
+			// kMsgHeaderLength
+		}
+		if(full)
+		{
+			endFrame<T>(p, idx, full);
+			return;
+		}
+		bool last = kStreamStateLast == stream.state;
+		for(size_t n = 0; stream.followers && n < p->streams.size(); ++n)
+		{
+			// only part of the frame is to be sent, and maybe
+			// not to all of them: split them
+			bool followerLast = kStreamStateLast == p->streams[n].state;
+			if((stream.followers & (1 << n)) && (last || followerLast))
+			{
+				splitFrame(p, idx, StreamIdx(n));
+				if(followerLast)
+					endFrame<T>(p, StreamIdx(n), false);
+			}
+		}
+		if(last)
+			endFrame<T>(p, idx, false);
+	}
 	template <typename T>
-	void send(Priv* p) {
-		size_t size = p->v.size(); // TODO: customise this for smaller frames
-		if(clientActive && isStreaming(p, kStreamIdxWatch))
-			gui.sendBuffer(p->guiBufferId, (T*)p->v.data(), size / sizeof(T));
-		if(isStreaming(p, kStreamIdxLog))
-			p->logger->log((float*)p->v.data(), size / sizeof(float));
-	}
-	void startWatching(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration);
+	void endFrame(Priv* p, StreamIdx idx, bool full)
+	{
+		Stream& stream = p->streams[idx];
+		if(!full)
+		{
+			// when a stream stops, we need to fill
+			// up all the remaining space with zeros
+			// TODO: remove this when we support
+			// variable-length blocks
+			if(kTimestampSample == p->timestampMode)
+			{
+				memset(stream.v + stream.count, 0, stream.relTimestampsOffset - stream.count);
+				memset(stream.v + stream.countRelTimestamps, 0, stream.frameSize - stream.countRelTimestamps);
+			} else
+				memset(stream.v + stream.count, 0, stream.frameSize - stream.count);
+		}
+		// TODO: in order to even out the CPU load,
+		// incoming data should be copied out of the
+		// audio thread one value at a time
+		// avoiding big copies like this one
+		// OTOH, we'll need to ensure only full blocks
+		// are sent so that we don't lose track of the
+		// header
+		uint32_t dests = stream.followers | (1 << idx);
+		size_t numValues = (stream.count - kMsgHeaderLength) / sizeof(T);
+		uint32_t done = 0;
+		for(size_t n = 0; n < p->streams.size(); ++n)
+		{
+			if(!(dests & (1 << n)))
+				continue;
+			Stream& dest = p->streams[n];
+			send<T>(p, StreamIdx(n), stream, numValues);
+			dest.count = 0;
+			dest.following = false;
+			if(kStreamStateLast == dest.state)
+			{
+				if(kStreamIdxLog == n)
+				{
+					logTrailer(p, numValues);
+					p->logger->requestFlush();
+				}
+				dest.state = kStreamStateNo;
+				done |= 1 << n;
+			}
+		}
+		stream.followers = 0;
+		if(done)
+		{
+			// only now that all the copies are out
+			for(size_t n = 0; n < p->streams.size(); ++n)
+			{
+				if(done & (1 << n))
+					releaseBuffer(p, StreamIdx(n));
+			}
+			updateSometingToDo(p);
+		}
+	}
+	void logTrailer(Priv* p, size_t numValues)
+	{
+		uint32_t trailer[2] = { kLogTrailerMagic, uint32_t(numValues) };
+		p->logger->log((float*)trailer, sizeof(trailer) / sizeof(float));
+	}
+	template <typename T>
+	void send(Priv* p, StreamIdx idx, const Stream& stream, size_t numValues) {
+		size_t size = stream.frameSize;
+		if(kStreamIdxWatch == idx && clientActive)
+			transport.sendBuffer(p->guiBufferId, stream.v, size, p->type[0]);
+		if(kStreamIdxLog == idx)
+			p->logger->log((float*)stream.v, size / sizeof(float));
+		if(kStreamIdxTap == idx)
+			tapPush(p->tap, stream, numValues);
+	}
+	void releaseBuffer(Priv* p, StreamIdx idx)
+	{
+		Stream& stream = p->streams[idx];
+		if(!stream.buffer)
+			return;
+		MsgToNrt msg {
+			.priv = p,
+			.cmd = MsgToNrt::kCmdReleasedBuffer,
+			.args = {
+				(uintptr_t)stream.buffer,
+			},
+		};
+		pipe.writeRt(msg);
+		stream.buffer = nullptr;
+		stream.v = nullptr;
+	}
+	void tapPush(Tap* tap, const Stream& stream, size_t numValues)
+	{
+		size_t writeIdx = tap->writeIdx.load(std::memory_order_relaxed);
+		size_t next = (writeIdx + 1) % tap->frames.size();
+		if(next == tap->readIdx.load(std::memory_order_acquire))
+		{
+			// the worker is falling behind: drop the frame
+			// rather than blocking
+			tap->dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		TapFrame& frame = tap->frames[writeIdx];
+		memcpy(frame.v.data(), stream.v, stream.frameSize);
+		frame.size = stream.frameSize;
+		frame.numValues = numValues;
+		tap->writeIdx.store(next, std::memory_order_release);
+	}
+	void startWatching(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration, size_t frameSize, FrameBuffer* buffer);
 	void stopWatching(Priv* p, AbsTimestamp timestampEnd);
 	void startControlling(Priv* p);
 	void stopControlling(Priv* p);
-	void startStreamAtFor(Priv* p, StreamIdx idx, AbsTimestamp startTimestamp, AbsTimestamp duration);
+	void startStreamAtFor(Priv* p, StreamIdx idx, AbsTimestamp startTimestamp, AbsTimestamp duration, size_t frameSize, FrameBuffer* buffer);
 	void stopStreamAt(Priv* p, StreamIdx idx, AbsTimestamp timestampEnd);
-	void startLogging(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration);
+	void startLogging(Priv* p, AbsTimestamp startTimestamp, AbsTimestamp duration, size_t frameSize, FrameBuffer* buffer);
 	void stopLogging(Priv* p, AbsTimestamp timestamp);
+	void startReplaying(Priv* p, Replay* r, AbsTimestamp startTimestamp);
+	void stopReplaying(Priv* p);
 	void setMonitoring(Priv* p, size_t period);
-	void setupLogger(Priv* p);
+	void setupLogger(Priv* p, size_t frameSize);
+	std::vector<uint8_t> logHeader(const std::string& name, const std::string& type, size_t frameSize);
 	void cleanupLogger(Priv* p);
 	Priv* findPrivByName(const std::string& str);
 	void sendJsonResponse(JSONValue* watcher, WSServer::CallingThread thread);
 	bool controlCallback(JSONObject& root);
-	Details* doReg(WatcherBase* that, std::string name, TimestampMode timestampMode, const std::string& typeName, size_t typeSize);
+	Details* doReg(WatcherBase* that, std::string name, TimestampMode timestampMode, const std::string& typeName, size_t typeSize, size_t frameSize);
 	std::vector<Priv*> vec;
+	std::vector<unsigned char> monitorFrame;
+	size_t monitorCount = 0;
+	unsigned int monitorBufferId;
+	uint32_t nextId = 0;
+	std::vector<Replay*> replays;
+	std::mutex replaysMutex;
+	std::vector<Tap*> taps;
+	std::vector<Derived*> deriveds; // protected by tapsMutex
+	std::mutex tapsMutex;
+	Batch* batch = nullptr; // the one the RT thread is going through
+	// frame buffers not currently held by any stream
+	std::vector<FrameBuffer*> bufferPool;
+	size_t bufferBytesInUse = 0;
+	std::mutex buffersMutex;
 	float sampleRate = 0;
-	Gui& gui;
+	size_t blockSize = 0; // as passed to setup()
+	AbsTimestamp tickLength = 0; // between full ticks
+	AbsTimestamp lastFullTick = 0;
+	bool hadFullTick = false;
+	WatcherManager(WatcherTransport* transport, bool ownsTransport);
+	WatcherTransport& transport;
+	bool ownsTransport;
+	Gui* gui = nullptr;
+	// commands may come from more than one transport thread
+	std::mutex controlMutex;
 	bool clientActive = true;
 };
 
@@ -374,15 +847,15 @@ public:
 	Watcher(const std::string& name, T value = 0) : Watcher(name, WatcherManager::kTimestampBlock, Bela_getDefaultWatcherManager(), value) {}
 #endif // ! WATCHER_DISABLE_DEFAULT
 #ifdef WATCHER_DISABLE_DEFAULT
-	Watcher(const std::string& name, WatcherManager::TimestampMode timestampMode, WatcherManager* wm, T value = 0)
+	Watcher(const std::string& name, WatcherManager::TimestampMode timestampMode, WatcherManager* wm, T value = 0, size_t frameSize = WatcherManager::kDefaultFrameSize)
 #else
-	Watcher(const std::string& name, WatcherManager::TimestampMode timestampMode = WatcherManager::kTimestampBlock, WatcherManager* wm = Bela_getDefaultWatcherManager(), T value = 0)
+	Watcher(const std::string& name, WatcherManager::TimestampMode timestampMode = WatcherManager::kTimestampBlock, WatcherManager* wm = Bela_getDefaultWatcherManager(), T value = 0, size_t frameSize = WatcherManager::kDefaultFrameSize)
 #endif
 		:
 		wm(wm)
 	{
 		if(wm)
-			d = wm->reg<T>(this, name, timestampMode);
+			d = wm->reg<T>(this, name, timestampMode, frameSize);
 		set(value);
 	}
 	virtual ~Watcher() {
@@ -13,13 +13,249 @@ let Watcher = {
   backwCompatibility: true,
   backwTypes: [],
   watchers: [],
-  processList: (watchers) => {
+  timestampModes: [],
+  // these mirror the constants in WatcherManager
+  kTimestampBlock: 0,
+  kTimestampSample: 1,
+  kMsgHeaderLength: 8,
+  kBufSize: 4096 + 8,
+  kRelTimestampSize: 4,
+  // names rather than constructors so that this can be serialised into
+  // the worker. char is unsigned on the ARM boards the backend runs on
+  typeInfo: {
+    c: { size: 1, array: 'Uint8Array' },
+    j: { size: 4, array: 'Uint32Array' },
+    i: { size: 4, array: 'Int32Array' },
+    f: { size: 4, array: 'Float32Array' },
+    d: { size: 8, array: 'Float64Array' },
+  },
+  monitorBufferId: -1,
+  // maps from buffer index and from watcher id to index in watchers
+  bufferIdToIndex: [],
+  spectrumBufferIdToIndex: [],
+  idToIndex: [],
+  processList: (watchers, monitorBufferId) => {
     this.backwTypes = watchers.map((v) => {
       return v.type;
     });
     this.watchers = watchers.map((v) => {
       return v.name;
     });
+    this.timestampModes = watchers.map((v) => {
+      return v.timestampMode;
+    });
+    Watcher.bufferIdToIndex = [];
+    Watcher.spectrumBufferIdToIndex = [];
+    Watcher.idToIndex = [];
+    for(let n = 0; n < watchers.length; ++n) {
+      // buffers are only assigned once a watcher is first watched
+      // (or its spectrum requested): until then these are -1
+      if(watchers[n].bufferId >= 0)
+        Watcher.bufferIdToIndex[watchers[n].bufferId] = n;
+      if(watchers[n].spectrumBufferId >= 0)
+        Watcher.spectrumBufferIdToIndex[watchers[n].spectrumBufferId] = n;
+      Watcher.idToIndex[watchers[n].id] = n;
+    }
+    if(undefined !== monitorBufferId)
+      Watcher.monitorBufferId = monitorBufferId;
+  },
+  // same as WatcherManager::getRelTimestampsOffset()
+  getRelTimestampsOffset: (dataSize, bufSize) => {
+    let maxElements = Math.floor((bufSize - Watcher.kMsgHeaderLength) / (dataSize + Watcher.kRelTimestampSize));
+    let offset = maxElements * dataSize + Watcher.kMsgHeaderLength;
+    return offset & ~(Watcher.kRelTimestampSize - 1);
+  },
+  // Decode one frame without copying: the returned buf (and relTimestamps,
+  // in kTimestampSample mode) are views on the memory backing bytes, which
+  // can be an ArrayBuffer or a typed array. Frames can be of any size
+  // (see the frameSizes argument of the watch and log commands): the
+  // layout is derived from their length.
+  decodeFrame: (bytes, type, timestampMode) => {
+    let info = Watcher.typeInfo[type];
+    if(!info)
+      return;
+    let buffer = bytes;
+    let byteOffset = 0;
+    let byteLength = bytes.byteLength;
+    if(ArrayBuffer.isView(bytes)) {
+      buffer = bytes.buffer;
+      byteOffset = bytes.byteOffset;
+    }
+    if(byteOffset % 8) {
+      // typed arrays need aligned offsets: only copy if they aren't
+      buffer = buffer.slice(byteOffset, byteOffset + byteLength);
+      byteOffset = 0;
+    }
+    let view = new DataView(buffer, byteOffset, Watcher.kMsgHeaderLength);
+    let timestamp = view.getUint32(4, true) * 4294967296 + view.getUint32(0, true);
+    let ArrayType = globalThis[info.array];
+    let numValues = Math.floor((byteLength - Watcher.kMsgHeaderLength) / info.size);
+    let relTimestamps;
+    if(Watcher.kTimestampSample == timestampMode) {
+      let offset = Watcher.getRelTimestampsOffset(info.size, byteLength);
+      numValues = Math.floor((offset - Watcher.kMsgHeaderLength) / info.size);
+      relTimestamps = new Uint32Array(buffer, byteOffset + offset, numValues);
+    }
+    return {
+      timestamp: timestamp,
+      buf: new ArrayType(buffer, byteOffset + Watcher.kMsgHeaderLength, numValues),
+      relTimestamps: relTimestamps,
+    };
+  },
+  // these mirror WatcherManager::Spectrum
+  kSpectrumHeaderLength: 16,
+  kSpectrumFlagPeak: 1,
+  spectrumWindows: [ 'rect', 'hann', 'hamming', 'blackman' ],
+  // Decode a frame sent in response to the spectrum command: a
+  // timestamp (that of the latest value in the window), a header and
+  // size / 2 + 1 magnitudes, where bin k is at k * sampleRate / size Hz.
+  // The magnitudes are a view on the memory backing bytes.
+  decodeSpectrumFrame: (bytes) => {
+    let buffer = bytes;
+    let byteOffset = 0;
+    if(ArrayBuffer.isView(bytes)) {
+      buffer = bytes.buffer;
+      byteOffset = bytes.byteOffset;
+    }
+    if(byteOffset % 4) {
+      buffer = buffer.slice(byteOffset, byteOffset + bytes.byteLength);
+      byteOffset = 0;
+    }
+    let headerLength = Watcher.kMsgHeaderLength + Watcher.kSpectrumHeaderLength;
+    if(bytes.byteLength < headerLength)
+      return;
+    let view = new DataView(buffer, byteOffset, headerLength);
+    let size = view.getUint32(8, true);
+    let flags = view.getUint32(20, true);
+    let numBins = Math.min(size / 2 + 1, Math.floor((bytes.byteLength - headerLength) / 4));
+    return {
+      timestamp: view.getUint32(4, true) * 4294967296 + view.getUint32(0, true),
+      spectrum: {
+        size: size,
+        hop: view.getUint32(12, true),
+        averages: view.getUint32(16, true),
+        peak: !!(flags & Watcher.kSpectrumFlagPeak),
+        window: Watcher.spectrumWindows[(flags >> 8) & 0xff],
+      },
+      buf: new Float32Array(buffer, byteOffset + headerLength, numBins),
+    };
+  },
+  kLogTrailerMagic: 0x646e6557, // mirrors WatcherManager::kLogTrailerMagic
+  kLogHeaderMagic: 0x76687457, // mirrors WatcherManager::kLogHeaderMagic
+  // Decode a whole log file, as written by the log command or by the
+  // spectrum command with logs set. Logs don't record the timestamp mode,
+  // so pass that of the watcher. pointerSize is that of the board that
+  // wrote the log. Returns { name, type, frameSize, frames }.
+  decodeLog: (bytes, timestampMode, pointerSize = 4) => {
+    if(ArrayBuffer.isView(bytes))
+      bytes = bytes.buffer.slice(bytes.byteOffset, bytes.byteOffset + bytes.byteLength);
+    let u8 = new Uint8Array(bytes);
+    let strings = [];
+    let offset = 0;
+    for(let n = 0; n < 3; ++n) {
+      let end = u8.indexOf(0, offset);
+      if(end < 0)
+        return;
+      strings.push(String.fromCharCode(...u8.subarray(offset, end)));
+      offset = end + 1;
+    }
+    if("watcher" !== strings[0])
+      return;
+    offset += 4 + pointerSize; // pid and pointer
+    offset = Math.ceil(offset / 4) * 4;
+    if(offset + 12 > u8.length)
+      return;
+    // version 1 ended here, and its frames were all kBufSize large
+    let fields = new DataView(bytes, offset, 12);
+    let frameSize = 4096 + Watcher.kMsgHeaderLength;
+    if(Watcher.kLogHeaderMagic === fields.getUint32(0, true)) {
+      frameSize = fields.getUint32(8, true);
+      offset += 12;
+    }
+    let type = strings[2];
+    let isSpectrum = "spectrum" === type;
+    let frames = [];
+    for(; frameSize && offset + frameSize <= u8.length; offset += frameSize) {
+      let frameBytes = new Uint8Array(bytes, offset, frameSize);
+      let frame = isSpectrum ? Watcher.decodeSpectrumFrame(frameBytes) : Watcher.decodeFrame(frameBytes, type, timestampMode);
+      if(frame)
+        frames.push(frame);
+    }
+    // a log that was stopped ends with a trailer giving the number of
+    // values in its last frame, the rest of which is zero padding
+    let last = frames[frames.length - 1];
+    if(!isSpectrum && last && offset + 8 <= u8.length) {
+      let trailer = new DataView(bytes, offset, 8);
+      let numValues = trailer.getUint32(4, true);
+      if(Watcher.kLogTrailerMagic === trailer.getUint32(0, true) && numValues < last.buf.length) {
+        last.buf = last.buf.subarray(0, numValues);
+        if(last.relTimestamps)
+          last.relTimestamps = last.relTimestamps.subarray(0, numValues);
+      }
+    }
+    return {
+      name: strings[1],
+      type: type,
+      frameSize: frameSize,
+      frames: frames,
+    };
+  },
+  // Decode the frame that gathers all the monitoring values sent in one
+  // tick: a timestamp followed by packed (uint32 id, value) entries, see
+  // WatcherManager::monitorAppend(). Returns one element per entry.
+  decodeMonitorFrame: (bytes, types, watchers) => {
+    let buffer = bytes;
+    let byteOffset = 0;
+    if(ArrayBuffer.isView(bytes)) {
+      buffer = bytes.buffer;
+      byteOffset = bytes.byteOffset;
+    }
+    let view = new DataView(buffer, byteOffset, bytes.byteLength);
+    let timestamp = view.getUint32(4, true) * 4294967296 + view.getUint32(0, true);
+    let ret = [];
+    let offset = Watcher.kMsgHeaderLength;
+    while(offset + 4 <= view.byteLength) {
+      let k = Watcher.idToIndex[view.getUint32(offset, true)];
+      let info = Watcher.typeInfo[types[k]];
+      if(undefined === k || !info || offset + 4 + info.size > view.byteLength)
+        break; // padding, or a watcher we don't know about yet
+      offset += 4;
+      let value;
+      switch(types[k]) {
+        case 'c': value = view.getUint8(offset); break;
+        case 'j': value = view.getUint32(offset, true); break;
+        case 'i': value = view.getInt32(offset, true); break;
+        case 'f': value = view.getFloat32(offset, true); break;
+        case 'd': value = view.getFloat64(offset, true); break;
+      }
+      offset += info.size;
+      ret.push({
+        timestamp: timestamp,
+        buf: [ value ],
+        watcher: watchers[k],
+      });
+    }
+    return ret;
+  },
+  // Bela.data.buffers[x] are normally typed arrays, which are decoded in
+  // place. Older versions of the core GUI hand out plain arrays (of
+  // one-character strings for 'c'), which are copied once into a
+  // per-watcher scratch buffer that is reused across frames.
+  scratch: [],
+  toBytes: (k, buffer, type) => {
+    if(ArrayBuffer.isView(buffer) || buffer instanceof ArrayBuffer)
+      return buffer;
+    let info = Watcher.typeInfo[type];
+    let scratch = Watcher.scratch[k];
+    if(!scratch || scratch.type !== type || scratch.length < buffer.length)
+      scratch = Watcher.scratch[k] = new globalThis[info.array](buffer.length);
+    scratch.type = type;
+    if('c' === type) {
+      for(let n = 0; n < buffer.length; ++n)
+        scratch[n] = buffer[n].charCodeAt(0);
+    } else
+      scratch.set(buffer);
+    return scratch.subarray(0, buffer.length);
   },
   parseInputData: (buffers, list, useList) => {
     if(!buffers)
@@ -38,51 +274,77 @@ let Watcher = {
       }
       if(!buffers[k])
         continue;
-      let timestampBuf;
+      if(k === Watcher.monitorBufferId) {
+        let bytes = Watcher.toBytes(k, buffers[k], 'j');
+        retBufs.push(...Watcher.decodeMonitorFrame(bytes, this.backwTypes, this.watchers));
+        continue;
+      }
+      let spectrumIdx = Watcher.spectrumBufferIdToIndex[k];
+      if(undefined !== spectrumIdx) {
+        let frame = Watcher.decodeSpectrumFrame(Watcher.toBytes(k, buffers[k], 'f'));
+        if(frame) {
+          frame.watcher = this.watchers[spectrumIdx];
+          retBufs.push(frame);
+        }
+        continue;
+      }
+      let idx = Watcher.bufferIdToIndex[k];
+      if(undefined === idx)
+        continue;
       let type = buffers[k].type;
       if(!type) {
         // when running with old version of the core GUI, type has to be set elsewhere
         backwCompatibility = true;
-        type = this.backwTypes[k];
+        type = this.backwTypes[idx];
       }
-      switch(type)
-      {
-        case 'c':
-          // absurb reverse mapping of an absurd fwd mapping
-          let intArr = buffers[k].slice(0, 8).map((e) => {
-            return e.charCodeAt(0);
-          });
-          timestampBuf = new Uint8Array(intArr);
-          buf = buffers[k].slice(8);
-          break;
-        case 'j': // unsigned int
-          timestampBuf = new Uint32Array(buffers[k].slice(0, 2))
-          buf = buffers[k].slice(2);
-          break;
-        case 'i': // int
-          timestampBuf = new Int32Array(buffers[k].slice(0, 2))
-          buf = buffers[k].slice(2);
-          break;
-        case 'f': // float
-          timestampBuf = new Float32Array(buffers[k].slice(0, 2));
-          buf = buffers[k].slice(2);
-          break;
-        case 'd':
-          timestampBuf = new Float64Array(buffers[k].slice(0, 1));
-          buf = buffers[k].slice(1);
-          break;
-        default:
-          console.log("Unknown buffer type ", type);
-          continue;
+      if(!Watcher.typeInfo[type]) {
+        console.log("Unknown buffer type ", type);
+        continue;
       }
-      let timestampUint32 = new Uint32Array(timestampBuf.buffer);
-      let timestamp = timestampUint32[0] * (1 << 32) + timestampUint32[1];
-      retBufs.push({
-        timestamp: timestamp,
-        buf: buf,
-        watcher: this.watchers[k],
-      });
+      let frame = Watcher.decodeFrame(Watcher.toBytes(k, buffers[k], type), type, this.timestampModes[idx]);
+      frame.watcher = this.watchers[idx];
+      retBufs.push(frame);
     }
     return retBufs;
   },
+  // Decode frames off the main thread. Post an array of
+  // { bytes, type, timestampMode, watcher } to the returned worker: the
+  // ArrayBuffers backing bytes are transferred (so they are no longer
+  // usable on the main thread) and handed back to onDecoded() as the
+  // backing store of the decoded frames.
+  createWorker: (onDecoded) => {
+    let members = [ 'kTimestampBlock', 'kTimestampSample', 'kMsgHeaderLength',
+      'kBufSize', 'kRelTimestampSize', 'typeInfo', 'getRelTimestampsOffset', 'decodeFrame' ];
+    let src = "let Watcher = {\n" + members.map((m) => {
+      let v = Watcher[m];
+      return m + ": " + ('function' === typeof(v) ? v.toString() : JSON.stringify(v));
+    }).join(",\n") + "\n};\n" + Watcher.workerMain.toString() + "\nworkerMain();\n";
+    let url = URL.createObjectURL(new Blob([ src ], { type: 'text/javascript' }));
+    let worker = new Worker(url);
+    URL.revokeObjectURL(url);
+    if(onDecoded)
+      worker.onmessage = (e) => onDecoded(e.data);
+    return worker;
+  },
+  decodeInWorker: (worker, frames) => {
+    worker.postMessage(frames, Watcher.transferList(frames.map((f) => f.bytes)));
+  },
+  transferList: (views) => {
+    let set = new Set();
+    for(let v of views)
+      set.add(ArrayBuffer.isView(v) ? v.buffer : v);
+    return Array.from(set);
+  },
+  // runs inside the worker
+  workerMain: () => {
+    onmessage = (e) => {
+      let out = e.data.map((f) => {
+        let frame = Watcher.decodeFrame(f.bytes, f.type, f.timestampMode);
+        frame.watcher = f.watcher;
+        return frame;
+      });
+      let set = new Set(out.map((f) => f.buf.buffer));
+      postMessage(out, Array.from(set));
+    };
+  },
 };
@@ -0,0 +1,163 @@
+#pragma once
+
+// Shared-memory layout used by WatcherShmTransport and WatcherShmClient.
+// It doesn't depend on Bela, so local processes can build the client
+// with just this header and WatcherShmClient.cpp.
+//
+// The segment contains:
+// - two broadcast rings written by the WatcherManager process and read by
+//   any number of clients: one with the frames of all the buffers, one
+//   with the JSON control responses. The writer never waits for the
+//   readers: a reader that falls behind loses data, and it can tell.
+// - a queue of JSON commands written by the clients and read by the
+//   WatcherManager process, protected by a process-shared mutex.
+// - a heartbeat refreshed by the clients, so that the WatcherManager
+//   process stops sending once they have all gone, even if they crashed
+//   without detaching.
+
+#include <atomic>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+
+namespace WatcherShm {
+static constexpr const char* kDefaultName = "/bela-watcher";
+static constexpr uint32_t kMagic = 0x68637457; // "Wtch"
+static constexpr uint32_t kVersion = 2;
+static constexpr size_t kCmdSlots = 16;
+static constexpr size_t kCmdSlotSize = 4096;
+static constexpr size_t kAlign = 8;
+// bufferId of the records in the responses ring
+static constexpr uint32_t kResponseId = ~0u;
+// readers are considered gone if the heartbeat is older than this
+static constexpr uint64_t kReaderTimeoutMs = 1000;
+
+// Each record in a ring starts with this and is followed by size bytes
+// of payload. For frames, the payload is the same as what the Gui
+// receives: a timestamp followed by the values.
+struct Record {
+	uint32_t recordSize; // including this header and padding. 0: wrap around
+	uint32_t bufferId;
+	uint32_t size;
+	char type;
+	char padding[3];
+};
+
+struct Ring {
+	uint64_t offset; // of the data from the start of the segment
+	uint64_t size;
+	// readers can rely on the bytes between committed - size and
+	// committed as long as reserved hasn't gone past their position +
+	// size. Both only ever grow.
+	std::atomic<uint64_t> reserved;
+	std::atomic<uint64_t> committed;
+};
+
+struct Header {
+	uint32_t magic; // written last by the creator
+	uint32_t version;
+	std::atomic<uint32_t> numReaders;
+	std::atomic<uint64_t> heartbeat; // in ms, from nowMs()
+	Ring frames;
+	Ring responses;
+	pthread_mutex_t cmdMutex;
+	uint32_t cmdRead;
+	uint32_t cmdWrite;
+	char cmds[kCmdSlots][kCmdSlotSize];
+};
+
+static inline uint64_t nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline size_t alignUp(size_t size)
+{
+	return (size + kAlign - 1) & ~(kAlign - 1);
+}
+
+// Single writer. Never blocks. Returns false if the record is too large
+// for the ring.
+static inline bool ringWrite(Ring& ring, uint8_t* segment, uint32_t bufferId, char type, const void* data, size_t size)
+{
+	size_t recordSize = alignUp(sizeof(Record) + size);
+	if(recordSize > ring.size / 2)
+		return false;
+	uint8_t* base = segment + ring.offset;
+	uint64_t pos = ring.committed.load(std::memory_order_relaxed);
+	size_t offset = pos % ring.size;
+	size_t wrapOffset = ring.size;
+	if(offset + recordSize > ring.size)
+	{
+		// not enough room before the end
+		wrapOffset = offset;
+		pos += ring.size - offset;
+		offset = 0;
+	}
+	ring.reserved.store(pos + recordSize, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	if(wrapOffset + sizeof(Record) <= ring.size)
+		((Record*)(base + wrapOffset))->recordSize = 0;
+	Record* record = (Record*)(base + offset);
+	record->recordSize = recordSize;
+	record->bufferId = bufferId;
+	record->size = size;
+	record->type = type;
+	memcpy(record + 1, data, size);
+	ring.committed.store(pos + recordSize, std::memory_order_release);
+	return true;
+}
+} // namespace WatcherShm
+
+class WatcherShmClient {
+public:
+	// points straight into the shared memory: call release() when done,
+	// and only trust the data if it returns true
+	struct Frame {
+		uint32_t bufferId;
+		char type;
+		const void* data;
+		size_t size;
+		uint64_t timestamp() const {
+			uint64_t timestamp = 0;
+			if(size >= sizeof(timestamp))
+				memcpy(&timestamp, data, sizeof(timestamp));
+			return timestamp;
+		}
+		uint64_t pos;
+		uint64_t next;
+	};
+	WatcherShmClient() = default;
+	~WatcherShmClient();
+	WatcherShmClient(const WatcherShmClient&) = delete;
+	WatcherShmClient& operator=(const WatcherShmClient&) = delete;
+	// returns 0 on success
+	int attach(const std::string& name = WatcherShm::kDefaultName);
+	void detach();
+	// get the next frame, if any. Frames sent before attach() are skipped.
+	// This, readResponse() and sendCommand() also tell the server that
+	// the client is alive: call one of them at least every
+	// WatcherShm::kReaderTimeoutMs, or frames will stop coming.
+	bool peek(Frame& frame);
+	// returns false if the frame was overwritten while you were using it
+	bool release(const Frame& frame);
+	// send a JSON command, e.g.: {"watcher":[{"cmd":"list"}]}
+	bool sendCommand(const std::string& json);
+	// get the next JSON response, if any
+	bool readResponse(std::string& json);
+	// number of frames or responses lost because we were too slow
+	size_t getLost() { return lost; }
+private:
+	bool peek(WatcherShm::Ring& ring, uint64_t& readPos, Frame& frame);
+	bool release(WatcherShm::Ring& ring, uint64_t& readPos, const Frame& frame);
+	WatcherShm::Header* header = nullptr;
+	size_t segmentSize = 0;
+	uint64_t framesPos = 0;
+	uint64_t responsesPos = 0;
+	size_t lost = 0;
+};
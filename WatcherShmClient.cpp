@@ -0,0 +1,156 @@
+#include "WatcherShm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace WatcherShm;
+
+WatcherShmClient::~WatcherShmClient()
+{
+	detach();
+}
+
+int WatcherShmClient::attach(const std::string& name)
+{
+	detach();
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if(fd < 0)
+		return -errno;
+	struct stat st;
+	if(fstat(fd, &st) || size_t(st.st_size) < sizeof(Header))
+	{
+		close(fd);
+		return -EINVAL;
+	}
+	void* ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == ptr)
+		return -errno;
+	Header* h = (Header*)ptr;
+	if(kMagic != h->magic || kVersion != h->version)
+	{
+		munmap(ptr, st.st_size);
+		return -EPROTO;
+	}
+	header = h;
+	segmentSize = st.st_size;
+	framesPos = header->frames.committed.load(std::memory_order_acquire);
+	responsesPos = header->responses.committed.load(std::memory_order_acquire);
+	lost = 0;
+	header->heartbeat = nowMs();
+	header->numReaders++;
+	return 0;
+}
+
+void WatcherShmClient::detach()
+{
+	if(!header)
+		return;
+	header->numReaders--;
+	munmap(header, segmentSize);
+	header = nullptr;
+}
+
+bool WatcherShmClient::peek(Ring& ring, uint64_t& readPos, Frame& frame)
+{
+	uint8_t* base = (uint8_t*)header + ring.offset;
+	while(1)
+	{
+		uint64_t committed = ring.committed.load(std::memory_order_acquire);
+		if(readPos == committed)
+			return false;
+		if(committed - readPos > ring.size)
+		{
+			// we were lapped: start again from the latest
+			lost++;
+			readPos = committed;
+			return false;
+		}
+		size_t offset = readPos % ring.size;
+		if(offset + sizeof(Record) > ring.size)
+		{
+			readPos += ring.size - offset;
+			continue;
+		}
+		Record record = *(Record*)(base + offset);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(ring.reserved.load(std::memory_order_relaxed) > readPos + ring.size)
+			continue; // overwritten while we read it: the check above will resync
+		if(0 == record.recordSize)
+		{
+			readPos += ring.size - offset;
+			continue;
+		}
+		frame.bufferId = record.bufferId;
+		frame.type = record.type;
+		frame.data = base + offset + sizeof(Record);
+		frame.size = record.size;
+		frame.pos = readPos;
+		frame.next = readPos + record.recordSize;
+		return true;
+	}
+}
+
+bool WatcherShmClient::release(Ring& ring, uint64_t& readPos, const Frame& frame)
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	bool valid = ring.reserved.load(std::memory_order_relaxed) <= frame.pos + ring.size;
+	readPos = frame.next;
+	if(!valid)
+		lost++;
+	return valid;
+}
+
+bool WatcherShmClient::peek(Frame& frame)
+{
+	if(!header)
+		return false;
+	header->heartbeat = nowMs();
+	return peek(header->frames, framesPos, frame);
+}
+
+bool WatcherShmClient::release(const Frame& frame)
+{
+	if(!header)
+		return false;
+	return release(header->frames, framesPos, frame);
+}
+
+bool WatcherShmClient::readResponse(std::string& json)
+{
+	if(!header)
+		return false;
+	header->heartbeat = nowMs();
+	Frame frame;
+	while(peek(header->responses, responsesPos, frame))
+	{
+		json.assign((const char*)frame.data, frame.size);
+		if(release(header->responses, responsesPos, frame))
+			return true;
+	}
+	return false;
+}
+
+bool WatcherShmClient::sendCommand(const std::string& json)
+{
+	if(!header || json.size() >= kCmdSlotSize)
+		return false;
+	header->heartbeat = nowMs();
+	int ret = pthread_mutex_lock(&header->cmdMutex);
+	if(EOWNERDEAD == ret)
+		pthread_mutex_consistent(&header->cmdMutex); // a client died holding it
+	else if(ret)
+		return false;
+	bool ok = false;
+	uint32_t next = (header->cmdWrite + 1) % kCmdSlots;
+	if(next != header->cmdRead)
+	{
+		memcpy(header->cmds[header->cmdWrite], json.c_str(), json.size() + 1);
+		header->cmdWrite = next;
+		ok = true;
+	}
+	pthread_mutex_unlock(&header->cmdMutex);
+	return ok;
+}
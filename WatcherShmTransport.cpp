@@ -0,0 +1,183 @@
+#include "WatcherShmTransport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace WatcherShm;
+
+// set while commandThread is calling the callback, so that responses
+// sent from there aren't passed on as if they came from next's own thread
+static thread_local bool inShmCallback = false;
+
+WatcherShmTransport::WatcherShmTransport(const std::string& name, size_t framesRingSize, WatcherTransport* next) :
+	name(name), next(next)
+{
+	framesRingSize = alignUp(framesRingSize);
+	size_t framesOffset = alignUp(sizeof(Header));
+	size_t responsesOffset = framesOffset + framesRingSize;
+	segmentSize = responsesOffset + kResponsesRingSize;
+	// start afresh in case a previous instance didn't clean up
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if(fd < 0)
+	{
+		fprintf(stderr, "WatcherShmTransport: unable to create %s: %s\n", name.c_str(), strerror(errno));
+		return;
+	}
+	if(ftruncate(fd, segmentSize))
+	{
+		fprintf(stderr, "WatcherShmTransport: unable to resize %s: %s\n", name.c_str(), strerror(errno));
+		close(fd);
+		shm_unlink(name.c_str());
+		return;
+	}
+	void* ptr = mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == ptr)
+	{
+		fprintf(stderr, "WatcherShmTransport: unable to map %s: %s\n", name.c_str(), strerror(errno));
+		shm_unlink(name.c_str());
+		return;
+	}
+	// ftruncate() zeroed it all
+	Header* h = (Header*)ptr;
+	h->version = kVersion;
+	h->numReaders = 0;
+	h->heartbeat = 0;
+	h->frames.offset = framesOffset;
+	h->frames.size = framesRingSize;
+	h->frames.reserved = 0;
+	h->frames.committed = 0;
+	h->responses.offset = responsesOffset;
+	h->responses.size = kResponsesRingSize;
+	h->responses.reserved = 0;
+	h->responses.committed = 0;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&h->cmdMutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	h->cmdRead = 0;
+	h->cmdWrite = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	h->magic = kMagic;
+	header = h;
+	commandThread = std::thread(&WatcherShmTransport::readCommands, this);
+}
+
+WatcherShmTransport::~WatcherShmTransport()
+{
+	shouldStop = true;
+	if(commandThread.joinable())
+		commandThread.join();
+	if(header)
+	{
+		header->magic = 0;
+		munmap(header, segmentSize);
+		shm_unlink(name.c_str());
+	}
+}
+
+unsigned int WatcherShmTransport::registerBuffer(char type, size_t size)
+{
+	// keep the ids consistent with what next's clients see
+	if(next)
+		return next->registerBuffer(type, size);
+	return nextBufferId++;
+}
+
+void WatcherShmTransport::doSendBuffer(unsigned int id, const void* data, size_t size, char type)
+{
+	if(header && readersAlive.load(std::memory_order_relaxed))
+		ringWrite(header->frames, (uint8_t*)header, id, type, data, size);
+	// we only get here from one thread at a time, so next can skip its
+	// own arbitration and never defers anything
+	if(next)
+		forwardBuffer(*next, id, data, size, type);
+}
+
+void WatcherShmTransport::setControlCallback(ControlCallback callback)
+{
+	{
+		std::lock_guard<std::mutex> lock(callbackMutex);
+		this->callback = callback;
+	}
+	if(next)
+		next->setControlCallback(callback);
+}
+
+void WatcherShmTransport::sendControl(JSONValue* root, WSServer::CallingThread thread)
+{
+	if(header)
+	{
+		std::string str = JSON::ws2s(JSON::Stringify(root));
+		std::lock_guard<std::mutex> lock(responsesMutex);
+		if(!ringWrite(header->responses, (uint8_t*)header, kResponseId, 'c', str.c_str(), str.size()))
+			fprintf(stderr, "WatcherShmTransport: response of %zu bytes is too large\n", str.size());
+	}
+	if(next)
+		next->sendControl(root, inShmCallback ? WSServer::kThreadOther : thread);
+}
+
+unsigned int WatcherShmTransport::numActiveConnections()
+{
+	// a reader that crashed never decremented numReaders
+	unsigned int count = header && readersAlive.load(std::memory_order_relaxed) ? header->numReaders.load() : 0;
+	if(next)
+		count += next->numActiveConnections();
+	return count;
+}
+
+void WatcherShmTransport::readCommands()
+{
+	char cmd[kCmdSlotSize];
+	while(!shouldStop)
+	{
+		readersAlive = header->numReaders && nowMs() - header->heartbeat < kReaderTimeoutMs;
+		bool got = false;
+		int ret = pthread_mutex_lock(&header->cmdMutex);
+		if(EOWNERDEAD == ret)
+		{
+			pthread_mutex_consistent(&header->cmdMutex);
+			ret = 0;
+		}
+		if(!ret)
+		{
+			if(header->cmdRead != header->cmdWrite)
+			{
+				memcpy(cmd, header->cmds[header->cmdRead], sizeof(cmd));
+				cmd[sizeof(cmd) - 1] = '\0';
+				header->cmdRead = (header->cmdRead + 1) % kCmdSlots;
+				got = true;
+			}
+			pthread_mutex_unlock(&header->cmdMutex);
+		}
+		if(!got)
+		{
+			usleep(kCommandPollUs);
+			continue;
+		}
+		JSONValue* value = JSON::Parse(cmd);
+		if(!value || !value->IsObject())
+		{
+			fprintf(stderr, "WatcherShmTransport: could not parse command %s\n", cmd);
+			delete value;
+			continue;
+		}
+		JSONObject root = value->AsObject();
+		{
+			std::lock_guard<std::mutex> lock(callbackMutex);
+			if(callback)
+			{
+				inShmCallback = true;
+				callback(root);
+				inShmCallback = false;
+			}
+		}
+		delete value;
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "WatcherTransport.h"
+#include "WatcherShm.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Publishes everything in a shared-memory segment (see WatcherShm.h) so
+// that local processes can consume it with WatcherShmClient, without
+// going through the websocket. If next is given, everything is also
+// forwarded to it, e.g.: to keep the browser GUI working at the same time.
+// Frames only reach next through this, so next can be created with a
+// deferredSize of 0.
+class WatcherShmTransport : public WatcherTransport {
+public:
+	WatcherShmTransport(const std::string& name = WatcherShm::kDefaultName, size_t framesRingSize = 1 << 20, WatcherTransport* next = nullptr);
+	~WatcherShmTransport();
+	// whether the shared memory was set up successfully
+	bool isValid() { return header; }
+	unsigned int registerBuffer(char type, size_t size) override;
+	void setControlCallback(ControlCallback callback) override;
+	void sendControl(JSONValue* root, WSServer::CallingThread thread) override;
+	unsigned int numActiveConnections() override;
+protected:
+	void doSendBuffer(unsigned int id, const void* data, size_t size, char type) override;
+private:
+	static constexpr size_t kResponsesRingSize = 1 << 18;
+	static constexpr unsigned int kCommandPollUs = 10000;
+	void readCommands();
+	std::string name;
+	WatcherTransport* next;
+	WatcherShm::Header* header = nullptr;
+	size_t segmentSize = 0;
+	unsigned int nextBufferId = 0;
+	ControlCallback callback;
+	std::mutex callbackMutex;
+	std::mutex responsesMutex;
+	std::thread commandThread;
+	// whether any reader has been heard from lately, updated by
+	// commandThread so that the RT thread doesn't need the time
+	std::atomic<bool> readersAlive{false};
+	volatile bool shouldStop = false;
+};
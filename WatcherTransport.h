@@ -0,0 +1,267 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <libraries/Gui/Gui.h>
+
+// How WatcherManager talks to its consumers: buffers carry the frames,
+// control carries the JSON commands and responses.
+//
+// Frames come from the RT thread and from non-RT threads, but the
+// channels underneath only take one sender at a time. Whoever is sending
+// holds `sender`. The RT thread never waits for it: if a non-RT thread
+// holds it, the frame is copied to `deferred` and sent by whichever thread
+// gets to send next. The RT thread only sends up to kRtDeferredBytes of
+// those at a time, non-RT threads send all of them.
+class WatcherTransport {
+public:
+	typedef std::function<void(JSONObject&)> ControlCallback;
+	static constexpr size_t kDefaultDeferredSize = 1 << 18;
+	// deferredSize is in bytes. A transport that is only ever sent to
+	// through another one, e.g.: the next of a WatcherShmTransport, never
+	// defers anything and can be given 0.
+	WatcherTransport(size_t deferredSize = kDefaultDeferredSize) : deferred(deferredSize) {}
+	virtual ~WatcherTransport() {}
+	// returns the id to pass to sendBuffer(). Called from the non-RT
+	// thread. size is in bytes.
+	virtual unsigned int registerBuffer(char type, size_t size) = 0;
+	// called from the RT thread. size is in bytes and is a multiple of
+	// the size of type.
+	void sendBuffer(unsigned int id, const void* data, size_t size, char type)
+	{
+		if(!tryLock(kSenderRt))
+			return defer(id, data, size, type);
+		// frames still deferred have to go out first
+		if(sendDeferredLocked(kRtDeferredBytes))
+			doSendBuffer(id, data, size, type);
+		else
+			defer(id, data, size, type);
+		unlock();
+	}
+	// called from any non-RT thread. Waits while another thread is
+	// sending.
+	void sendBufferNonRt(unsigned int id, const void* data, size_t size, char type)
+	{
+		while(!tryLock(kSenderNonRt))
+			usleep(kSenderWaitUs);
+		sendDeferredLocked(kAllDeferredBytes);
+		doSendBuffer(id, data, size, type);
+		unlock();
+		// the RT thread may have deferred a frame before we unlocked
+		trySendDeferred(kSenderNonRt);
+	}
+	// called from the RT thread once per block, so that deferred frames
+	// don't wait for the next one it sends
+	void sendDeferred()
+	{
+		trySendDeferred(kSenderRt);
+	}
+	// frames from the RT thread that didn't fit in deferred
+	size_t getDeferredDropped() { return deferredDropped.load(std::memory_order_relaxed); }
+	// the callback may be invoked from any non-RT thread
+	virtual void setControlCallback(ControlCallback callback) = 0;
+	virtual void sendControl(JSONValue* root, WSServer::CallingThread thread) = 0;
+	// no data is sent when this is 0
+	virtual unsigned int numActiveConnections() = 0;
+protected:
+	// never called from two threads at once
+	virtual void doSendBuffer(unsigned int id, const void* data, size_t size, char type) = 0;
+	// for transports that wrap another one: call from doSendBuffer()
+	static void forwardBuffer(WatcherTransport& to, unsigned int id, const void* data, size_t size, char type)
+	{
+		to.doSendBuffer(id, data, size, type);
+	}
+private:
+	enum {
+		kSenderNone,
+		kSenderRt,
+		kSenderNonRt,
+	};
+	static constexpr size_t kRtDeferredBytes = 1 << 14;
+	static constexpr size_t kAllDeferredBytes = ~size_t(0);
+	static constexpr unsigned int kSenderWaitUs = 100;
+	static constexpr uint32_t kDeferredWrap = ~0u;
+	struct DeferredHeader {
+		uint32_t size; // kDeferredWrap: continues from the start
+		uint32_t id;
+		char type;
+		char padding[7];
+	};
+	static size_t deferredRecordSize(size_t size)
+	{
+		return (sizeof(DeferredHeader) + size + 7) & ~size_t(7);
+	}
+	bool tryLock(int who)
+	{
+		int none = kSenderNone;
+		return sender.compare_exchange_strong(none, who, std::memory_order_acquire);
+	}
+	void unlock()
+	{
+		sender.store(kSenderNone, std::memory_order_release);
+	}
+	void trySendDeferred(int who)
+	{
+		if(deferredRead.load(std::memory_order_relaxed) == deferredWrite.load(std::memory_order_acquire))
+			return;
+		if(!tryLock(who))
+			return; // whoever has it will send them
+		sendDeferredLocked(kSenderRt == who ? kRtDeferredBytes : kAllDeferredBytes);
+		unlock();
+	}
+	// RT thread only
+	void defer(unsigned int id, const void* data, size_t size, char type)
+	{
+		size_t write = deferredWrite.load(std::memory_order_relaxed);
+		size_t read = deferredRead.load(std::memory_order_acquire);
+		size_t recordSize = deferredRecordSize(size);
+		if(recordSize > deferred.size())
+		{
+			deferredDropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		size_t offset = write % deferred.size();
+		size_t tail = deferred.size() - offset;
+		size_t needed = recordSize + (tail < recordSize ? tail : 0);
+		if(needed > deferred.size() - (write - read))
+		{
+			deferredDropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		if(tail < recordSize)
+		{
+			if(tail >= sizeof(DeferredHeader))
+				((DeferredHeader*)&deferred[offset])->size = kDeferredWrap;
+			write += tail;
+			offset = 0;
+		}
+		DeferredHeader* header = (DeferredHeader*)&deferred[offset];
+		header->size = size;
+		header->id = id;
+		header->type = type;
+		memcpy(header + 1, data, size);
+		deferredWrite.store(write + recordSize, std::memory_order_release);
+	}
+	// with sender held. Stops once it has sent maxBytes. Returns whether
+	// there is nothing left.
+	bool sendDeferredLocked(size_t maxBytes)
+	{
+		size_t read = deferredRead.load(std::memory_order_relaxed);
+		size_t write = deferredWrite.load(std::memory_order_acquire);
+		size_t sent = 0;
+		while(read != write && sent < maxBytes)
+		{
+			size_t offset = read % deferred.size();
+			size_t tail = deferred.size() - offset;
+			const DeferredHeader* header = (const DeferredHeader*)&deferred[offset];
+			if(tail < sizeof(DeferredHeader) || kDeferredWrap == header->size)
+			{
+				read += tail;
+				continue;
+			}
+			doSendBuffer(header->id, header + 1, header->size, header->type);
+			sent += header->size;
+			read += deferredRecordSize(header->size);
+		}
+		deferredRead.store(read, std::memory_order_release);
+		return read == write;
+	}
+	std::atomic<int> sender{kSenderNone};
+	// positions only ever grow: write - read is what is in there
+	std::vector<unsigned char> deferred;
+	std::atomic<size_t> deferredWrite{0}; // only written by the RT thread
+	std::atomic<size_t> deferredRead{0}; // only written with sender held
+	std::atomic<size_t> deferredDropped{0};
+};
+
+// Sends everything to the browser through the Bela Gui.
+class WatcherGuiTransport : public WatcherTransport {
+public:
+	WatcherGuiTransport(Gui& gui, size_t deferredSize = kDefaultDeferredSize) : WatcherTransport(deferredSize), gui(gui) {}
+	unsigned int registerBuffer(char type, size_t size) override {
+		return gui.setBuffer(type, size);
+	}
+	void setControlCallback(ControlCallback callback) override {
+		gui.setControlDataCallback([callback](JSONObject& json, void*) {
+			if(callback)
+				callback(json);
+			return true;
+		});
+	}
+	void sendControl(JSONValue* root, WSServer::CallingThread thread) override {
+		gui.sendControl(root, thread);
+	}
+	unsigned int numActiveConnections() override {
+		return gui.numActiveConnections();
+	}
+	Gui& getGui() {
+		return gui;
+	}
+protected:
+	void doSendBuffer(unsigned int id, const void* data, size_t size, char type) override {
+		switch(type)
+		{
+			case 'c':
+				gui.sendBuffer(id, (char*)data, size / sizeof(char));
+				break;
+			case 'j':
+				gui.sendBuffer(id, (unsigned int*)data, size / sizeof(unsigned int));
+				break;
+			case 'i':
+				gui.sendBuffer(id, (int*)data, size / sizeof(int));
+				break;
+			case 'f':
+				gui.sendBuffer(id, (float*)data, size / sizeof(float));
+				break;
+			case 'd':
+				gui.sendBuffer(id, (double*)data, size / sizeof(double));
+				break;
+		}
+	}
+private:
+	Gui& gui;
+};
+
+// Headless in-process transport for testing: everything that is sent is
+// kept in memory and commands are injected with control().
+// Not real-time safe.
+class WatcherStubTransport : public WatcherTransport {
+public:
+	struct Buffer {
+		char type;
+		size_t size;
+		std::vector<std::vector<unsigned char>> frames;
+	};
+	unsigned int registerBuffer(char type, size_t size) override {
+		buffers.push_back({type, size, {}});
+		return buffers.size() - 1;
+	}
+	void setControlCallback(ControlCallback callback) override {
+		this->callback = callback;
+	}
+	void sendControl(JSONValue* root, WSServer::CallingThread) override {
+		responses.push_back(JSON::ws2s(JSON::Stringify(root)));
+	}
+	unsigned int numActiveConnections() override {
+		return activeConnections;
+	}
+	// pass a command to the WatcherManager as if it came from a client
+	void control(JSONObject& root) {
+		if(callback)
+			callback(root);
+	}
+	std::vector<Buffer> buffers;
+	std::vector<std::string> responses;
+	unsigned int activeConnections = 1;
+protected:
+	void doSendBuffer(unsigned int id, const void* data, size_t size, char) override {
+		if(id < buffers.size())
+			buffers[id].frames.emplace_back((const unsigned char*)data, (const unsigned char*)data + size);
+	}
+private:
+	ControlCallback callback;
+};
@@ -140,6 +140,8 @@ function watcherControlSendToBela()
 	}
 	console.log("Sending ", obj);
 	sendCommand(obj);
+	if("watch" === obj.cmd)
+		requestWatcherList(); // the buffer is assigned on the first watch
 }
 
 function watcherSenderInit(obj, guiKey, parser)
@@ -212,7 +214,7 @@ function removeWatcherFromList(watcher) {
 function updateWatcherGuis(w, n) {
 	if(backwCompatibility)
 	{
-		backwTypes[n] = w.type;
+		backwTypes[w.bufferId] = w.type;
 	}
 	// avoid sending message to backend while we are updating
 	watcherGuiUpdatingFromBackend = true;
@@ -228,10 +230,26 @@ function updateWatcherGuis(w, n) {
 
 let latestTimestamp = 0;
 let sampleRate = 0;
+let monitorBufferId = -1;
+let bufferIdToName = {};
+let watcherTypes = [];
+let watcherNames = [];
+let unprocessedList = null; // for Watcher.processList()
+let watcherListTimeout;
 function updateWatcherList(data) {
-	setTimeout(requestWatcherList, 1234); // request a new one
+	// the list also comes in reply to other requests: only ever keep
+	// one poll pending
+	clearTimeout(watcherListTimeout);
+	watcherListTimeout = setTimeout(requestWatcherList, 1234); // request a new one
 	latestTimestamp = data.timestamp;
 	sampleRate = data.sampleRate;
+	monitorBufferId = data.monitorBufferId;
+	bufferIdToName = {};
+	for(let w of data.watchers)
+		bufferIdToName[w.bufferId] = w.name;
+	watcherTypes = data.watchers.map((w) => w.type);
+	watcherNames = data.watchers.map((w) => w.name);
+	unprocessedList = data.watchers;
 	sampleRateDiv.elt.innerText = sampleRate + "Hz";
 	latestTimestampDiv.elt.innerText = latestTimestamp;
 	let newList = data.watchers;
@@ -261,7 +279,15 @@ let controlCallback = (data) => {
 		console.log(data.watcher);
 }
 
+// the frame decoders are shared with the rest of the library
+function loadWatcherJs() {
+	let script = document.createElement('script');
+	script.src = "/libraries/Watcher/Watcher.js";
+	document.head.appendChild(script);
+}
+
 function setup() {
+	loadWatcherJs();
 	//Create a canvas of dimensions given by current browser window
 	createCanvas(windowWidth, windowHeight);
 
@@ -281,6 +307,25 @@ function setup() {
 	latestTimestampDiv = createElement("div", "").position(controlsLeft + 100, top);
 }
 
+// all the monitoring values sent in one tick come in a single frame, see
+// Watcher.decodeMonitorFrame()
+function parseMonitorFrame(buffer) {
+	if(typeof Watcher === 'undefined')
+		return; // not loaded yet
+	if(unprocessedList) {
+		Watcher.processList(unprocessedList, monitorBufferId);
+		unprocessedList = null;
+	}
+	let bytes = Watcher.toBytes(monitorBufferId, buffer, 'j');
+	for(let entry of Watcher.decodeMonitorFrame(bytes, watcherTypes, watcherNames)) {
+		let wgui = wGuis[entry.watcher];
+		if(wgui) {
+			wgui.monitorTimestamp.elt.innerText = entry.timestamp;
+			wgui.monitorValue.elt.innerText = formatNumber(wgui, entry.buf[0]);
+		}
+	}
+}
+
 let pastBuffer;
 let clientActiveTimeout;
 function draw() {
@@ -295,10 +340,16 @@ function draw() {
 	p.strokeWeight(1);
 	var linVerScale = 1;
 	var linVerOff = 0;
-	let keys = Object.keys(wGuis);
 	for(let k = 0; k < buffers.length; ++k)
 	{
-		if(keys.length < k) // haven't received a list yet
+		if(!buffers[k])
+			continue;
+		if(k === monitorBufferId) {
+			parseMonitorFrame(buffers[k]);
+			continue;
+		}
+		let name = bufferIdToName[k];
+		if(!(name in wGuis)) // haven't received a list yet
 			continue;
 		let timestampBuf;
 		let type = buffers[k].type;
@@ -340,14 +391,7 @@ function draw() {
 		}
 		let timestampUint32 = new Uint32Array(timestampBuf.buffer);
 		let timestamp = timestampUint32[0] * (1 << 32) + timestampUint32[1];
-		if(1 == buf.length) {
-			// "monitoring" message
-			let w = wGuis[keys[k]];
-			w.monitorTimestamp.elt.innerText = timestamp;
-			w.monitorValue.elt.innerText = formatNumber(w, buf[0]);
-			continue;
-		}
-		let obj = wGuis[keys[k]].watched;
+		let obj = wGuis[name].watched;
 		let bts = buffers[k].ts;
 		let now = performance.now();
 		// early return if the buffer has not been update since last set to watch